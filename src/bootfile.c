@@ -0,0 +1,404 @@
+// SPDX-FileCopyrightText: 2026 Frank Hunleth
+//
+// SPDX-License-Identifier: MIT
+//
+
+#include "erlinit.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Prewarm the page cache with the .beam files that the Erlang VM is about to
+// load. The order comes from the release's .boot file, which is an Erlang
+// term in the external term format. See
+// https://www.erlang.org/doc/apps/erts/erl_ext_dist.html.
+//
+// The parts of the boot script that matter here are:
+//
+//   {path, ["$ROOT/lib/kernel-9.0/ebin", ...]}
+//   {primLoad, [error_handler, application, ...]}
+//   {apply, {application, load, [{application, stdlib, [..., {modules, [...]}, ...]}]}}
+//
+// Everything else is skipped.
+
+#define MAX_BOOT_FILE_SIZE (4 * 1024 * 1024)
+#define MAX_BOOT_PATHS 256
+#define MAX_ATOM_BYTES (255 * 4 + 1)
+
+#define VERSION_MAGIC       131
+#define NEW_FLOAT_EXT       70
+#define SMALL_INTEGER_EXT   97
+#define INTEGER_EXT         98
+#define FLOAT_EXT           99
+#define ATOM_EXT            100
+#define SMALL_TUPLE_EXT     104
+#define LARGE_TUPLE_EXT     105
+#define NIL_EXT             106
+#define STRING_EXT          107
+#define LIST_EXT            108
+#define BINARY_EXT          109
+#define SMALL_BIG_EXT       110
+#define LARGE_BIG_EXT       111
+#define MAP_EXT             116
+#define ATOM_UTF8_EXT       118
+#define SMALL_ATOM_UTF8_EXT 119
+
+struct boot_reader {
+    const unsigned char *p;
+    const unsigned char *end;
+
+    const char *release_base_dir;
+
+    char *paths[MAX_BOOT_PATHS];
+    int num_paths;
+    int last_hit;
+    int num_prewarmed;
+};
+
+static int has_bytes(struct boot_reader *r, size_t count)
+{
+    return (size_t) (r->end - r->p) >= count;
+}
+
+static int read_u8(struct boot_reader *r, unsigned int *v)
+{
+    if (!has_bytes(r, 1))
+        return -1;
+    *v = *r->p++;
+    return 0;
+}
+
+static int read_u16(struct boot_reader *r, unsigned int *v)
+{
+    if (!has_bytes(r, 2))
+        return -1;
+    *v = (r->p[0] << 8) | r->p[1];
+    r->p += 2;
+    return 0;
+}
+
+static int read_u32(struct boot_reader *r, unsigned int *v)
+{
+    if (!has_bytes(r, 4))
+        return -1;
+    *v = ((unsigned int) r->p[0] << 24) | (r->p[1] << 16) | (r->p[2] << 8) | r->p[3];
+    r->p += 4;
+    return 0;
+}
+
+static int skip_bytes(struct boot_reader *r, size_t count)
+{
+    if (!has_bytes(r, count))
+        return -1;
+    r->p += count;
+    return 0;
+}
+
+// Read an atom if that's what's next. Returns 1 on success, 0 if not an atom
+// and -1 on error.
+static int read_atom(struct boot_reader *r, char *name, size_t name_len)
+{
+    if (!has_bytes(r, 1))
+        return -1;
+
+    unsigned int len;
+    switch (*r->p) {
+    case ATOM_EXT:
+    case ATOM_UTF8_EXT:
+        r->p++;
+        if (read_u16(r, &len) < 0)
+            return -1;
+        break;
+    case SMALL_ATOM_UTF8_EXT:
+        r->p++;
+        if (read_u8(r, &len) < 0)
+            return -1;
+        break;
+    default:
+        return 0;
+    }
+
+    if (!has_bytes(r, len) || len >= name_len)
+        return -1;
+    memcpy(name, r->p, len);
+    name[len] = '\0';
+    r->p += len;
+    return 1;
+}
+
+static int skip_term(struct boot_reader *r);
+
+static int skip_terms(struct boot_reader *r, unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i++) {
+        if (skip_term(r) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int skip_term(struct boot_reader *r)
+{
+    unsigned int tag;
+    unsigned int len;
+    char atom[MAX_ATOM_BYTES];
+
+    if (!has_bytes(r, 1))
+        return -1;
+    int rc = read_atom(r, atom, sizeof(atom));
+    if (rc != 0)
+        return rc > 0 ? 0 : -1;
+
+    if (read_u8(r, &tag) < 0)
+        return -1;
+    switch (tag) {
+    case SMALL_INTEGER_EXT:
+        return skip_bytes(r, 1);
+    case INTEGER_EXT:
+        return skip_bytes(r, 4);
+    case NEW_FLOAT_EXT:
+        return skip_bytes(r, 8);
+    case FLOAT_EXT:
+        return skip_bytes(r, 31);
+    case NIL_EXT:
+        return 0;
+    case STRING_EXT:
+        return read_u16(r, &len) < 0 ? -1 : skip_bytes(r, len);
+    case BINARY_EXT:
+        return read_u32(r, &len) < 0 ? -1 : skip_bytes(r, len);
+    case SMALL_BIG_EXT:
+        return read_u8(r, &len) < 0 ? -1 : skip_bytes(r, len + 1);
+    case LARGE_BIG_EXT:
+        return read_u32(r, &len) < 0 ? -1 : skip_bytes(r, (size_t) len + 1);
+    case SMALL_TUPLE_EXT:
+        return read_u8(r, &len) < 0 ? -1 : skip_terms(r, len);
+    case LARGE_TUPLE_EXT:
+        return read_u32(r, &len) < 0 ? -1 : skip_terms(r, len);
+    case LIST_EXT:
+        return read_u32(r, &len) < 0 ? -1 : skip_terms(r, len + 1);
+    case MAP_EXT:
+        return read_u32(r, &len) < 0 ? -1 : skip_terms(r, 2 * len);
+    default:
+        elog(ELOG_DEBUG, "Unsupported term type %u in boot script", tag);
+        return -1;
+    }
+}
+
+static void add_path(struct boot_reader *r, const char *path, size_t len)
+{
+    // Expand the variables that erlinit passes to erlexec
+    char expanded[ERLINIT_PATH_MAX];
+    if (len > 5 && memcmp(path, "$ROOT", 5) == 0)
+        snprintf(expanded, sizeof(expanded), "%s%.*s", r->release_base_dir, (int) len - 5, path + 5);
+    else if (len > 12 && memcmp(path, "$RELEASE_LIB", 12) == 0)
+        snprintf(expanded, sizeof(expanded), "%s/lib%.*s", r->release_base_dir, (int) len - 12, path + 12);
+    else if (len > 13 && memcmp(path, "$ERTS_LIB_DIR", 13) == 0)
+        snprintf(expanded, sizeof(expanded), "%s%.*s", ERLANG_ERTS_LIB_DIR, (int) len - 13, path + 13);
+    else
+        snprintf(expanded, sizeof(expanded), "%.*s", (int) len, path);
+
+    if (expanded[0] != '/' || r->num_paths == MAX_BOOT_PATHS)
+        return;
+
+    r->paths[r->num_paths++] = strdup(expanded);
+}
+
+static int read_paths(struct boot_reader *r)
+{
+    unsigned int tag;
+    unsigned int count;
+
+    // The code path replaces any previous one
+    for (int i = 0; i < r->num_paths; i++)
+        free(r->paths[i]);
+    r->num_paths = 0;
+    r->last_hit = 0;
+
+    if (read_u8(r, &tag) < 0)
+        return -1;
+    if (tag == NIL_EXT)
+        return 0;
+    if (tag != LIST_EXT || read_u32(r, &count) < 0)
+        return -1;
+
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned int len;
+        if (read_u8(r, &tag) < 0)
+            return -1;
+        if (tag == STRING_EXT) {
+            if (read_u16(r, &len) < 0 || !has_bytes(r, len))
+                return -1;
+            add_path(r, (const char *) r->p, len);
+            r->p += len;
+        } else if (tag != NIL_EXT) {
+            // Paths with non-Latin-1 characters aren't encoded as strings
+            r->p--;
+            if (skip_term(r) < 0)
+                return -1;
+        }
+    }
+    return skip_term(r);
+}
+
+static void prewarm_module(struct boot_reader *r, const char *module)
+{
+    // Modules from the same application are usually listed together, so
+    // start with the directory that had the last one.
+    for (int i = 0; i < r->num_paths; i++) {
+        int index = (r->last_hit + i) % r->num_paths;
+        char beam_path[ERLINIT_PATH_MAX];
+        if (snprintf(beam_path, sizeof(beam_path), "%s/%s.beam", r->paths[index], module) >= (int) sizeof(beam_path))
+            continue;
+
+        if (readahead_file(beam_path) < 0)
+            continue;
+
+        r->last_hit = index;
+        r->num_prewarmed++;
+        return;
+    }
+}
+
+static int read_modules(struct boot_reader *r)
+{
+    unsigned int tag;
+    unsigned int count;
+
+    if (read_u8(r, &tag) < 0)
+        return -1;
+    if (tag == NIL_EXT)
+        return 0;
+    if (tag != LIST_EXT || read_u32(r, &count) < 0)
+        return -1;
+
+    for (unsigned int i = 0; i < count; i++) {
+        char module[MAX_ATOM_BYTES];
+        int rc = read_atom(r, module, sizeof(module));
+        if (rc < 0)
+            return -1;
+        else if (rc == 1)
+            prewarm_module(r, module);
+        else if (skip_term(r) < 0)
+            return -1;
+    }
+    return skip_term(r);
+}
+
+static int walk_term(struct boot_reader *r);
+
+static int walk_terms(struct boot_reader *r, unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i++) {
+        if (walk_term(r) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int walk_term(struct boot_reader *r)
+{
+    unsigned int tag;
+    unsigned int len;
+
+    if (!has_bytes(r, 1))
+        return -1;
+
+    switch (*r->p) {
+    case SMALL_TUPLE_EXT:
+    case LARGE_TUPLE_EXT:
+        read_u8(r, &tag);
+        if (tag == SMALL_TUPLE_EXT ? read_u8(r, &len) < 0 : read_u32(r, &len) < 0)
+            return -1;
+
+        if (len == 2) {
+            char name[MAX_ATOM_BYTES];
+            int rc = read_atom(r, name, sizeof(name));
+            if (rc < 0)
+                return -1;
+            if (rc == 1) {
+                if (strcmp(name, "path") == 0)
+                    return read_paths(r);
+                else if (strcmp(name, "primLoad") == 0 || strcmp(name, "modules") == 0)
+                    return read_modules(r);
+                else
+                    return walk_term(r);
+            }
+        }
+        return walk_terms(r, len);
+
+    case LIST_EXT:
+        read_u8(r, &tag);
+        return read_u32(r, &len) < 0 ? -1 : walk_terms(r, len + 1);
+
+    default:
+        return skip_term(r);
+    }
+}
+
+void prewarm_boot_modules(const char *boot_path, const char *release_base_dir)
+{
+    char path[ERLINIT_PATH_MAX];
+
+    // erlinit normally strips the .boot extension like erl wants
+    size_t len = strlen(boot_path);
+    if (len > 5 && strcmp(boot_path + len - 5, ".boot") == 0)
+        snprintf(path, sizeof(path), "%s", boot_path);
+    else
+        snprintf(path, sizeof(path), "%s.boot", boot_path);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        elog(ELOG_DEBUG, "Can't open %s to prewarm modules: %s", path, strerror(errno));
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size <= 0 || st.st_size > MAX_BOOT_FILE_SIZE) {
+        close(fd);
+        return;
+    }
+
+    unsigned char *contents = malloc(st.st_size);
+    if (!contents) {
+        close(fd);
+        return;
+    }
+
+    // Prewarming is only an optimization, so give up on short reads
+    ssize_t amount = 0;
+    while (amount < st.st_size) {
+        ssize_t rc = read(fd, contents + amount, st.st_size - amount);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            break;
+        amount += rc;
+    }
+    close(fd);
+    if (amount != st.st_size) {
+        elog(ELOG_DEBUG, "Can't read %s to prewarm modules", path);
+        free(contents);
+        return;
+    }
+
+    struct boot_reader r;
+    memset(&r, 0, sizeof(r));
+    r.p = contents;
+    r.end = contents + amount;
+    r.release_base_dir = release_base_dir;
+
+    unsigned int version;
+    if (read_u8(&r, &version) < 0 || version != VERSION_MAGIC || walk_term(&r) < 0)
+        elog(ELOG_DEBUG, "Stopped prewarming at unexpected data in %s", path);
+
+    elog(ELOG_DEBUG, "Prewarmed %d modules from %s", r.num_prewarmed, path);
+
+    for (int i = 0; i < r.num_paths; i++)
+        free(r.paths[i]);
+    free(contents);
+}
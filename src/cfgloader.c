@@ -125,7 +125,7 @@ static int load_config(const char *filename,
     return argc;
 }
 
-void merge_config(int argc, char *argv[], int *merged_argc, char **merged_argv)
+void merge_config(const char *config_path, int argc, char *argv[], int *merged_argc, char **merged_argv)
 {
     // When merging, argv[0] is first, then the
     // arguments from erlinit.config and then any
@@ -134,7 +134,7 @@ void merge_config(int argc, char *argv[], int *merged_argc, char **merged_argv)
     *merged_argc = 1;
     merged_argv[0] = argv[0];
 
-    *merged_argc += load_config("/etc/erlinit.config",
+    *merged_argc += load_config(config_path,
                                 &merged_argv[1],
                                 MAX_ARGC - argc);
 
@@ -6,83 +6,287 @@
 #include "erlinit.h"
 
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 
-int system_cmd(const char *cmd, char *output_buffer, int length)
+// Split a command into arguments. Arguments are separated by spaces and
+// may be quoted with ' or ". A backslash escapes the next character except
+// inside single quotes. The strings all point into one allocation that's
+// freed along with the array by free_cmd_argv().
+static char **split_cmd(const char *cmd)
 {
-    elog(ELOG_DEBUG, "system_cmd '%s'", cmd);
-    int pipefd[2];
-    if (pipe(pipefd) < 0) {
+    size_t max_args = 8;
+    int argc = 0;
+    char **argv = malloc((max_args + 1) * sizeof(char *));
+    char *out = malloc(strlen(cmd) + 1);
+    if (!argv || !out)
+        goto oom;
+
+    argv[0] = out;
+    const char *in = cmd;
+    for (;;) {
+        while (*in == ' ' || *in == '\t')
+            in++;
+        if (*in == '\0')
+            break;
+
+        if ((size_t) argc == max_args) {
+            max_args *= 2;
+            char **new_argv = realloc(argv, (max_args + 1) * sizeof(char *));
+            if (!new_argv)
+                goto oom;
+            argv = new_argv;
+        }
+        argv[argc++] = out;
+
+        char quote = 0;
+        while (*in != '\0' && (quote || (*in != ' ' && *in != '\t'))) {
+            if (quote == *in) {
+                quote = 0;
+            } else if (!quote && (*in == '\'' || *in == '"')) {
+                quote = *in;
+            } else if (*in == '\\' && quote != '\'' && in[1] != '\0') {
+                *out++ = *++in;
+            } else {
+                *out++ = *in;
+            }
+            in++;
+        }
+        *out++ = '\0';
+    }
+    if (argc == 0) {
+        free(argv[0]);
+        argv[0] = NULL;
+    }
+    argv[argc] = NULL;
+    return argv;
+
+oom:
+    free(argv);
+    free(out);
+    return NULL;
+}
+
+static void free_cmd_argv(char **argv)
+{
+    if (argv) {
+        free(argv[0]);
+        free(argv);
+    }
+}
+
+static int ms_left(const struct timespec *deadline)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long ms = (deadline->tv_sec - now.tv_sec) * 1000LL + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    return ms > 0 ? (int) ms : 0;
+}
+
+// Returns 1 if the command had to be killed, 0 if it exited, or -1 on error
+static int wait_for_exit(pid_t pid, const struct timespec *deadline, int *status)
+{
+    int killed = 0;
+    int pidfd = deadline ? open_pidfd(pid) : -1;
+    for (;;) {
+        pid_t rc = waitpid(pid, status, deadline ? WNOHANG : 0);
+        if (rc == pid)
+            break;
+        if (rc < 0 && errno != EINTR) {
+            killed = -1;
+            break;
+        }
+        if (rc == 0) {
+            // pidfds become readable on exit. Otherwise poll.
+            int timeout_ms = ms_left(deadline);
+            if (timeout_ms > 0 && pidfd >= 0) {
+                struct pollfd fds = {pidfd, POLLIN, 0};
+                if (poll(&fds, 1, timeout_ms) != 0)
+                    continue;
+            } else if (timeout_ms > 0) {
+                struct timespec pause = {0, 10000000};
+                nanosleep(&pause, NULL);
+                continue;
+            }
+
+            kill(pid, SIGKILL);
+            killed = 1;
+            deadline = NULL;
+        }
+    }
+    if (pidfd >= 0)
+        close(pidfd);
+    return killed;
+}
+
+static void read_output(int fd, char *output_buffer, int length, struct timespec *deadline)
+{
+    // Read straight into the caller's buffer. Anything that doesn't fit is
+    // drained so that the command doesn't block on a full pipe.
+    length--; // Save room for a '\0'
+    int index = 0;
+    for (;;) {
+        if (deadline) {
+            struct pollfd fds = {fd, POLLIN, 0};
+            int timeout_ms = ms_left(deadline);
+            if (timeout_ms == 0 || poll(&fds, 1, timeout_ms) == 0)
+                break;
+        }
+
+        char discard[256];
+        ssize_t amt;
+        if (index < length)
+            amt = read(fd, &output_buffer[index], length - index);
+        else
+            amt = read(fd, discard, sizeof(discard));
+
+        if (amt > 0) {
+            if (index < length)
+                index += amt;
+        } else if (amt == 0 || errno != EINTR) {
+            break;
+        }
+    }
+    output_buffer[index] = '\0';
+}
+
+// Run a command and wait for it to exit. If output_buffer is set, stdout
+// is captured to it. The command is killed if it's still running after
+// timeout_ms. Returns the exit status or -1 on error.
+static int spawn_cmd(const char *stage_name, const char *cmd, int timeout_ms, char *output_buffer, int length)
+{
+    char **argv = split_cmd(cmd);
+    if (!argv || !argv[0]) {
+        elog(ELOG_ERROR, "Can't run empty command '%s'", cmd);
+        free_cmd_argv(argv);
+        return -1;
+    }
+
+    int pipefd[2] = {-1, -1};
+    if (output_buffer && pipe2(pipefd, O_CLOEXEC) < 0) {
         elog(ELOG_ERROR, "pipe");
+        free_cmd_argv(argv);
         return -1;
     }
 
-    pid_t pid = fork();
-    if (pid == 0) {
-        // child
-        int devnull = open("/dev/null", O_RDWR);
-        if (devnull < 0) {
-            elog(ELOG_ERROR, "Couldn't open /dev/null");
-            exit(EXIT_FAILURE);
-        }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (output_buffer) {
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+        posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+    }
 
-        close(pipefd[0]); // no reads from the pipe
-        close(STDIN_FILENO);
-        close(STDOUT_FILENO);
-        if (dup2(devnull, STDIN_FILENO) < 0)
-            elog(ELOG_ERROR, "dup2 devnull");
-        if (dup2(pipefd[1], STDOUT_FILENO) < 0)
-            elog(ELOG_ERROR, "dup2 pipe");
-        close(devnull);
-
-        char *cmd_copy = strdup(cmd);
-        char *exec_path = strtok(cmd_copy, " ");
-        char *exec_argv[16];
-        int arg = 0;
-
-        exec_argv[arg++] = exec_path;
-        while ((exec_argv[arg] = strtok(NULL, " ")) != NULL)
-            arg++;
-        exec_argv[arg] = 0;
-        if (exec_path)
-            execvp(exec_path, exec_argv);
-
-        // Not supposed to reach here.
-        elog(ELOG_ERROR, "execvp '%s' failed", cmd);
-        exit(EXIT_FAILURE);
-    } else {
-        // parent
-        close(pipefd[1]); // No writes to the pipe
+    // PID 1 blocks signals for its event loop. Don't pass that on.
+    posix_spawnattr_t attr;
+    sigset_t no_signals;
+    sigemptyset(&no_signals);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &no_signals);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
 
-        length--; // Save room for a '\0'
-        int index = 0;
-        int amt;
-        while (index != length &&
-                (amt = read(pipefd[0], &output_buffer[index], length - index)) > 0)
-            index += amt;
-        output_buffer[index] = '\0';
-        close(pipefd[0]);
+    int stage = timeline_begin_detail(stage_name, cmd);
+    pid_t pid;
+    extern char **environ;
+    int spawn_rc = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
 
-        int status;
-        for (;;) {
-            pid_t rc = waitpid(pid, &status, 0);
-            if (rc == pid)
-                break;
-            if (rc != -1 || errno != EINTR) {
-                elog(ELOG_ERROR, "waitpid failed for '%s': %d", cmd, errno);
-                return -1;
-            }
+    if (output_buffer)
+        close(pipefd[1]); // No writes to the pipe
+
+    if (spawn_rc != 0) {
+        elog(ELOG_ERROR, "Can't run '%s': %s", cmd, strerror(spawn_rc));
+        if (output_buffer) {
+            output_buffer[0] = '\0';
+            close(pipefd[0]);
         }
-        if (WIFEXITED(status)) {
-            return WEXITSTATUS(status);
-        } else {
-            elog(ELOG_ERROR, "'%s' didn't exit", cmd);
-            return -1;
+        timeline_end(stage);
+        free_cmd_argv(argv);
+        return -1;
+    }
+    timeline_set_pid(stage, pid);
+    free_cmd_argv(argv);
+
+    struct timespec deadline;
+    if (timeout_ms > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
         }
     }
+
+    if (output_buffer) {
+        read_output(pipefd[0], output_buffer, length, timeout_ms > 0 ? &deadline : NULL);
+        close(pipefd[0]);
+    }
+
+    int status;
+    int rc = wait_for_exit(pid, timeout_ms > 0 ? &deadline : NULL, &status);
+    timeline_end(stage);
+    if (rc < 0) {
+        elog(ELOG_ERROR, "waitpid failed for '%s': %d", cmd, errno);
+        return -1;
+    } else if (rc > 0) {
+        elog(ELOG_ERROR, "'%s' killed after %d ms", cmd, timeout_ms);
+        return -1;
+    } else if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    } else {
+        elog(ELOG_ERROR, "'%s' didn't exit", cmd);
+        return -1;
+    }
+}
+
+int system_cmd(const char *cmd, char *output_buffer, int length)
+{
+    elog(ELOG_DEBUG, "system_cmd '%s'", cmd);
+    return spawn_cmd("system_cmd", cmd, options.cmd_timeout_ms, output_buffer, length);
+}
+
+int run_cmd(const char *cmd, int timeout_ms)
+{
+    elog(ELOG_DEBUG, "run_cmd '%s'", cmd);
+    return spawn_cmd("run_cmd", cmd, timeout_ms, NULL, 0);
+}
+
+int fork_detached()
+{
+    // Double fork so that the process gets reparented to PID 1 and doesn't
+    // become a zombie of whatever the caller execs next.
+    pid_t pid = fork();
+    if (pid < 0) {
+        elog(ELOG_ERROR, "fork failed: %s", strerror(errno));
+        return -1;
+    }
+
+    if (pid == 0) {
+        pid_t grandchild = fork();
+        if (grandchild != 0)
+            _exit(grandchild < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+
+        return 0;
+    }
+
+    int status = 0;
+    pid_t rc;
+    do {
+        rc = waitpid(pid, &status, 0);
+    } while (rc < 0 && errno == EINTR);
+
+    if (rc != pid || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        elog(ELOG_ERROR, "fork failed for detached process");
+        return -1;
+    }
+    return 1;
 }
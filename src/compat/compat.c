@@ -8,6 +8,9 @@
 #include <string.h>
 #include <errno.h>
 #include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
 
 #include "sys/syscall.h"
 #include "linux/reboot.h"
@@ -83,6 +86,20 @@ ssize_t getrandom(void *buf, size_t buflen, unsigned int flags)
     return buflen;
 }
 
+int posix_fadvise(int fd, off_t offset, off_t len, int advice)
+{
+    // MacOS doesn't have posix_fadvise, so log it like the fixture does on Linux.
+    char path[PATH_MAX];
+    if (fcntl(fd, F_GETPATH, path) < 0)
+        strcpy(path, "unknown");
+
+    const char *work = getenv("WORK");
+    size_t work_len = work ? strlen(work) : 0;
+    const char *p = strncmp(path, work ? work : "", work_len) == 0 ? path + work_len : path;
+    fprintf(stderr, "fixture: posix_fadvise(\"%s\", %ld, %ld, %d)\n", p, (long) offset, (long) len, advice);
+    return 0;
+}
+
 // This is only needed for reboot, so hardcode most argument checks.
 long fake_syscall(long number, unsigned int magic, unsigned int magic2, unsigned int cmd, const void *arg)
 {
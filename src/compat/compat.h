@@ -55,6 +55,9 @@ int sigprocmask_noop(int how, const sigset_t *restrict set, sigset_t *restrict o
 
 #define mount(a,b,c,d,e) mount(a,b,d, (void*) c)
 #define umount(a) unmount(a, 0)
+#define MNT_DETACH 2
+#define umount2(a, b) unmount(a, MNT_FORCE)
+#define syncfs(fd) fsync(fd)
 
 // Missing SOCK_CLOEXEC
 #define SOCK_CLOEXEC  02000000
@@ -76,6 +79,10 @@ int sigprocmask_noop(int how, const sigset_t *restrict set, sigset_t *restrict o
 #define RLIMIT_RTTIME     104
 #define RLIMIT_MSGQUEUE   105
 
+// posix_fadvise
+#define POSIX_FADV_WILLNEED 3
+int posix_fadvise(int fd, off_t offset, off_t len, int advice);
+
 // syscall
 #define syscall fake_syscall
 long fake_syscall(long number, unsigned int magic, unsigned int magic2, unsigned int cmd, const void *arg);
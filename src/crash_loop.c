@@ -0,0 +1,166 @@
+// SPDX-FileCopyrightText: 2026 Frank Hunleth
+//
+// SPDX-License-Identifier: MIT
+//
+
+#include "erlinit.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// The crash loop file counts how many boots in a row ended with the Erlang
+// VM exiting soon after it started. It's only written when that count
+// changes so that a healthy device doesn't write to flash on every boot.
+//
+// The first line is "erlinit-crash-loop 2 <count> <fallback>". Anything
+// else counts as 0. When <fallback> is 1, erlinit boots the
+// --crash-loop-release-path release. It stays on it until the release
+// search path changes. To tell, the file has "check=" lines like the
+// release cache for each directory on the search path.
+
+#define CRASH_LOOP_HEADER "erlinit-crash-loop 2"
+#define MAX_CRASH_LOOP_LINE (ERLINIT_PATH_MAX + 64)
+
+struct crash_loop_state {
+    int count;
+    int fallback;
+    int release_changed;
+};
+
+static const char *crash_loop_path()
+{
+    return options.crash_loop_file ? options.crash_loop_file : DEFAULT_CRASH_LOOP_FILE;
+}
+
+static void crash_loop_load(struct crash_loop_state *state)
+{
+    memset(state, 0, sizeof(*state));
+
+    FILE *fp = fopen(crash_loop_path(), "r");
+    if (!fp)
+        return;
+
+    if (fscanf(fp, CRASH_LOOP_HEADER " %d %d\n", &state->count, &state->fallback) != 2 ||
+            state->count < 0) {
+        memset(state, 0, sizeof(*state));
+        fclose(fp);
+        return;
+    }
+
+    char line[MAX_CRASH_LOOP_LINE];
+    while (state->fallback && fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strncmp(line, "check=", 6) == 0 && !release_check_matches(line + 6))
+            state->release_changed = 1;
+    }
+    fclose(fp);
+}
+
+static void write_release_checks(FILE *fp)
+{
+    // These are for the normal release search path and not the fallback
+    const char *start = options.release_search_path ? options.release_search_path : DEFAULT_RELEASE_ROOT_DIR;
+    while (*start) {
+        size_t len = strcspn(start, ":");
+        if (len > 0) {
+            char path[ERLINIT_PATH_MAX];
+            char line[MAX_CRASH_LOOP_LINE];
+            snprintf(path, sizeof(path), "%.*s", (int) len, start);
+            release_check_format(line, sizeof(line), path);
+            fprintf(fp, "check=%s\n", line);
+        }
+        start += len;
+        if (*start == ':')
+            start++;
+    }
+}
+
+static void crash_loop_save(const struct crash_loop_state *state)
+{
+    // The device may be about to reboot or lose power, so write a new file
+    // and rename it over the old one. A truncated file would reset the count.
+    const char *path = crash_loop_path();
+    char tmp_path[ERLINIT_PATH_MAX + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp_path, "w");
+    if (!fp) {
+        elog(ELOG_WARNING, "Cannot write %s: %s", path, strerror(errno));
+        return;
+    }
+
+    fprintf(fp, CRASH_LOOP_HEADER " %d %d\n", state->count, state->fallback);
+    if (state->fallback)
+        write_release_checks(fp);
+
+    fflush(fp);
+    OK_OR_WARN(fsync(fileno(fp)), "fsync(%s) failed", tmp_path);
+    fclose(fp);
+
+    if (rename(tmp_path, path) < 0) {
+        elog(ELOG_WARNING, "Cannot write %s: %s", path, strerror(errno));
+        (void) unlink(tmp_path);
+    }
+}
+
+int crash_loop_use_fallback()
+{
+    if (options.crash_loop_limit <= 0 || !options.crash_loop_release_path)
+        return 0;
+
+    struct crash_loop_state state;
+    crash_loop_load(&state);
+    if (!state.fallback)
+        return 0;
+
+    if (state.release_changed) {
+        elog(ELOG_WARNING, "Release changed since the crash loop. Trying it again.");
+        memset(&state, 0, sizeof(state));
+        crash_loop_save(&state);
+        return 0;
+    }
+    return 1;
+}
+
+int crash_loop_record_crash()
+{
+    // Returns 1 if erlinit should halt rather than reboot
+    struct crash_loop_state state;
+    crash_loop_load(&state);
+    state.count++;
+    elog(ELOG_ERROR, "Erlang VM exited within %d seconds (%d time%s in a row)",
+         options.crash_loop_seconds, state.count, state.count == 1 ? "" : "s");
+
+    if (state.count < options.crash_loop_limit) {
+        crash_loop_save(&state);
+        return 0;
+    }
+
+    if (options.crash_loop_release_path && !state.fallback) {
+        elog(ELOG_ERROR, "Crash loop detected. Rebooting to the release in %s.", options.crash_loop_release_path);
+        state.count = 0;
+        state.fallback = 1;
+        crash_loop_save(&state);
+        return 0;
+    }
+
+    elog(ELOG_ERROR, "Crash loop detected. Halting instead of rebooting again.");
+    crash_loop_save(&state);
+    return 1;
+}
+
+void crash_loop_reset()
+{
+    // Only the count is cleared. Going back to the normal release after
+    // the fallback one has been up a while would just start the loop again.
+    struct crash_loop_state state;
+    crash_loop_load(&state);
+    if (state.count != 0) {
+        elog(ELOG_DEBUG, "Erlang VM is up. Clearing crash count.");
+        state.count = 0;
+        crash_loop_save(&state);
+    }
+}
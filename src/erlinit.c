@@ -12,6 +12,7 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -22,46 +23,17 @@
 
 #include <linux/reboot.h>
 #include <sys/reboot.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <sys/resource.h>
 #include <pwd.h>
 
-struct erl_run_info {
-    // This is the base directory for the release
-    // e.g., <base>/[release_name]
-    // The release_name directory is optional and may not be included. It
-    // is normally omitted by Nerves.
-    char *release_base_dir;
-
-    // This is the directory containing the release start scripts
-    // e.g., <release_base_dir>/releases/<version>
-    char *releases_version_dir;
-
-    // This is the search path for the .beams created by
-    // Elixir's Protocol consolidation code.
-    // e.g., <release_base_dir>/lib/*/consolidated
-    char *consolidated_protocols_path;
-
-    // This is the name of the release. It could be empty if there's
-    // no name and this is typical for Nerves.
-    char *release_name;
+#define DEFERRED_READY_PATH ERLINIT_RUN_DIR "/deferred_ready"
 
-    // ERTS version if specified by start_erl.data
-    char *erts_version;
-
-    // The directory containing ERTS
-    char *erts_dir;
-
-    // This is the path to the .boot file
-    char *boot_path;
-
-    // This is the path to sys.config
-    char *sys_config;
-
-    // This is the path to vm.args
-    char *vmargs_path;
-};
+// This is only different from ERLANG_ROOT_DIR with --resolve-release
+static const char *erlang_root_dir = ERLANG_ROOT_DIR;
 
 static void erlinit_asprintf(char **strp, const char *fmt, ...)
 {
@@ -121,7 +93,7 @@ static void find_erts_directory(const char *erts_version,
         if (is_directory(*erts_dir))
             return;
 
-        erlinit_asprintf(erts_dir, ERLANG_ROOT_DIR "/erts-%s", erts_version);
+        erlinit_asprintf(erts_dir, "%s/erts-%s", erlang_root_dir, erts_version);
         if (is_directory(*erts_dir))
             return;
 
@@ -135,7 +107,7 @@ static void find_erts_directory(const char *erts_version,
     if (options.release_include_erts)
         tmp_release_base_dir = release_base_dir;
     else
-        tmp_release_base_dir = ERLANG_ROOT_DIR;
+        tmp_release_base_dir = erlang_root_dir;
 
     struct dirent **namelist;
     int n = scandir(tmp_release_base_dir,
@@ -475,8 +447,10 @@ static void find_release(struct erl_run_info *run_info)
         options.release_search_path = strdup(DEFAULT_RELEASE_ROOT_DIR);
 
     // The user may specify several directories to be searched for
-    // releases. Pick the first one.
-    const char *search_path = strtok(options.release_search_path, ":");
+    // releases. Pick the first one. The option is left alone since the
+    // release cache needs it too.
+    char *search_paths = strdup(options.release_search_path);
+    const char *search_path = strtok(search_paths, ":");
     while (search_path != NULL) {
         if (find_release_dirs(search_path, 1, run_info)) {
             elog(ELOG_DEBUG, "Using release in %s.", run_info->releases_version_dir);
@@ -486,12 +460,14 @@ static void find_release(struct erl_run_info *run_info)
             find_boot_path(run_info->releases_version_dir, run_info->release_name, &run_info->boot_path);
             find_consolidated_dirs(run_info->release_base_dir, run_info);
 
+            free(search_paths);
             return;
         }
 
         elog(ELOG_WARNING, "No release found in %s.", search_path);
         search_path = strtok(NULL, ":");
     }
+    free(search_paths);
 #if 0
     if (sys_config) {
         free(sys_config);
@@ -502,7 +478,7 @@ static void find_release(struct erl_run_info *run_info)
         boot_path = NULL;
     }
 #endif
-    erlinit_asprintf(&run_info->release_base_dir, "%s", ERLANG_ROOT_DIR);
+    erlinit_asprintf(&run_info->release_base_dir, "%s", erlang_root_dir);
 }
 
 static int has_erts_library_directory()
@@ -609,44 +585,6 @@ static void update_time()
     }
 }
 
-static int run_cmd(const char *cmd)
-{
-    elog(ELOG_DEBUG, "run_cmd '%s'", cmd);
-
-    pid_t pid = fork();
-    if (pid == 0) {
-        // child
-        char *cmd_copy = strdup(cmd);
-        char *exec_path = strtok(cmd_copy, " ");
-        char *exec_argv[16];
-        int arg = 0;
-
-        exec_argv[arg++] = exec_path;
-        while ((exec_argv[arg] = strtok(NULL, " ")) != NULL)
-            arg++;
-        exec_argv[arg] = 0;
-        if (exec_path)
-            execvp(exec_path, exec_argv);
-
-        // Not supposed to reach here.
-        elog(ELOG_WARNING, "execvp '%s' failed", cmd);
-        exit(EXIT_FAILURE);
-    } else {
-        // parent
-        int status = -1;
-        int rc;
-        do {
-            rc = waitpid(pid, &status, 0);
-        } while (rc < 0 && errno == EINTR);
-
-        if ((rc < 0 && errno != ECHILD) || rc != pid) {
-            elog(ELOG_WARNING, "unexpected return from waitpid: rc=%d, errno=%d", rc, errno);
-            return -1;
-        }
-        return status;
-    }
-}
-
 static void drop_privileges()
 {
     if (options.gid > 0) {
@@ -672,56 +610,476 @@ static char **concat_options(char **argv, const char *option, int append)
     return argv;
 }
 
-static void child()
+static void setup_working_directory(const struct erl_run_info *run_info)
 {
+    // Set the working directory. First try a directory specified
+    // in the options, but if that doesn't work, go to the root of
+    // the release.
+    if (options.working_directory == NULL ||
+            chdir(options.working_directory) < 0) {
+        OK_OR_FATAL(chdir(run_info->release_base_dir), "Cannot chdir to release directory (%s)",
+                    run_info->release_base_dir);
+    }
+}
+
+// Boot stages run by child() before starting Erlang
+//
+// Stages that only change system-wide state (the clock, mounts, network
+// interfaces, the random number pool) may run in a forked worker process when
+// --parallel-boot is passed. Everything else modifies the child process's
+// memory, environment or working directory so it always runs in the child.
+// The order here is the order that the stages run without --parallel-boot.
+enum boot_stage_id {
+    STAGE_UPDATE_TIME = 0,
+    STAGE_MOUNT_FILESYSTEMS,
+    STAGE_FIND_RELEASE,
+    STAGE_FIND_ERTS_DIRECTORY,
+    STAGE_SETUP_ENVIRONMENT,
+    STAGE_SETUP_NETWORKING,
+    STAGE_WARN_UNUSED_TTY,
+    STAGE_SET_WORKING_DIRECTORY,
+    STAGE_SEEDRNG,
+    STAGE_PRE_RUN_EXEC,
+    NUM_BOOT_STAGES
+};
+
+#define STAGE_BIT(ID) (1 << (ID))
+
+struct boot_stage {
+    const char *name;
+    void (*run)(struct erl_run_info *run_info);
+    int depends_on;     // Bitmask of stages that need to complete first
+    int forkable;
+};
+
+static void stage_update_time(struct erl_run_info *run_info)
+{
+    (void) run_info;
     update_time();
+}
 
+static void stage_mount_filesystems(struct erl_run_info *run_info)
+{
+    (void) run_info;
     mount_filesystems();
+}
 
-    // Locate everything needed to configure the environment
-    // and pass to erlexec.
-    struct erl_run_info run_info;
-    memset(&run_info, 0, sizeof(run_info));
+static void stage_find_release(struct erl_run_info *run_info)
+{
+    if (crash_loop_use_fallback()) {
+        elog(ELOG_ERROR, "Crash loop detected. Looking for a release in %s.", options.crash_loop_release_path);
+        free(options.release_search_path);
+        options.release_search_path = strdup(options.crash_loop_release_path);
+        find_release(run_info);
+        return;
+    }
 
-    find_release(&run_info);
+    if (options.release_manifest && release_manifest_load(options.release_manifest, run_info) == 0)
+        return;
 
-    find_erts_directory(run_info.erts_version, run_info.release_base_dir, &run_info.erts_dir);
+    if (options.release_cache && release_cache_load(options.release_cache, run_info) == 0)
+        return;
+
+    find_release(run_info);
+}
 
+static void stage_find_erts_directory(struct erl_run_info *run_info)
+{
+    // Skip if the release manifest or cache already had it
+    if (run_info->erts_dir)
+        return;
+
+    find_erts_directory(run_info->erts_version, run_info->release_base_dir, &run_info->erts_dir);
+
+    if (options.release_cache)
+        release_cache_save(options.release_cache, run_info);
+}
+
+static void stage_setup_environment(struct erl_run_info *run_info)
+{
     // Set up $HOME
     setup_home_directory();
 
     // Set up the environment for running erlang.
-    setup_environment(&run_info);
+    setup_environment(run_info);
+}
+
+static void stage_setup_networking(struct erl_run_info *run_info)
+{
+    (void) run_info;
 
     // Set up the minimum networking we need for Erlang.
     setup_networking();
+}
+
+static void stage_warn_unused_tty(struct erl_run_info *run_info)
+{
+    (void) run_info;
 
     // Warn the user if they're on an inactive TTY
     if (options.warn_unused_tty)
         warn_unused_tty();
+}
 
-    // Set the working directory. First try a directory specified
-    // in the options, but if that doesn't work, go to the root of
-    // the release.
-    if (options.working_directory == NULL ||
-            chdir(options.working_directory) < 0) {
-        OK_OR_FATAL(chdir(run_info.release_base_dir), "Cannot chdir to release directory (%s)",
-                    run_info.release_base_dir);
-    }
+static void stage_set_working_directory(struct erl_run_info *run_info)
+{
+    setup_working_directory(run_info);
+}
+
+static void stage_seedrng(struct erl_run_info *run_info)
+{
+    (void) run_info;
 
     // Restore the seed for the random number generator (failures ignored)
     //
-    // This has to happen after `mount_filesystems()` and setting up the
-    // environment. Running it before pre_run_exec allows that program to use
-    // random numbers.
+    // This has to happen after `mount_filesystems()` since the seed is
+    // usually on an application partition. Running it before pre_run_exec
+    // allows that program to use random numbers.
     //
     // It's not uncommon for pre_run_exec to be used to start hardware entropy
     // daemons to help with random number generation too.
-    seedrng();
+    //
+    // Saving a new seed for the next boot can wait with --defer-noncritical.
+    if (options.defer_noncritical)
+        seedrng_load();
+    else
+        seedrng();
+}
+
+static void stage_pre_run_exec(struct erl_run_info *run_info)
+{
+    (void) run_info;
 
     // Optionally run a "pre-run" program
     if (options.pre_run_exec)
-        run_cmd(options.pre_run_exec);
+        run_cmd(options.pre_run_exec, options.cmd_timeout_ms);
+}
+
+static const struct boot_stage boot_stages[NUM_BOOT_STAGES] = {
+    // Filesystems are mounted after fixing the clock so that mount times
+    // and fsck checks aren't confused by a clock in 1970.
+    [STAGE_UPDATE_TIME] = {"update_time", stage_update_time, 0, 1},
+    [STAGE_MOUNT_FILESYSTEMS] = {"mount_filesystems", stage_mount_filesystems, STAGE_BIT(STAGE_UPDATE_TIME), 1},
+
+    // The release may be on one of the extra mounts
+    [STAGE_FIND_RELEASE] = {"find_release", stage_find_release, STAGE_BIT(STAGE_MOUNT_FILESYSTEMS), 0},
+    [STAGE_FIND_ERTS_DIRECTORY] = {"find_erts_directory", stage_find_erts_directory, STAGE_BIT(STAGE_FIND_RELEASE), 0},
+    [STAGE_SETUP_ENVIRONMENT] = {"setup_environment", stage_setup_environment, STAGE_BIT(STAGE_FIND_ERTS_DIRECTORY), 0},
+
+    // Networking and the hostname don't depend on the release
+    [STAGE_SETUP_NETWORKING] = {"setup_networking", stage_setup_networking, 0, 1},
+    [STAGE_WARN_UNUSED_TTY] = {"warn_unused_tty", stage_warn_unused_tty, 0, 1},
+    [STAGE_SET_WORKING_DIRECTORY] = {"set_working_directory", stage_set_working_directory, STAGE_BIT(STAGE_SETUP_ENVIRONMENT), 0},
+    [STAGE_SEEDRNG] = {"seedrng", stage_seedrng, STAGE_BIT(STAGE_MOUNT_FILESYSTEMS), 1},
+
+    // The pre-run program expects everything else to be ready
+    [STAGE_PRE_RUN_EXEC] = {"pre_run_exec", stage_pre_run_exec, STAGE_BIT(NUM_BOOT_STAGES) - 1 - STAGE_BIT(STAGE_PRE_RUN_EXEC), 0},
+};
+
+static int boot_stage_enabled(int id)
+{
+    switch (id) {
+    case STAGE_WARN_UNUSED_TTY:
+        return options.warn_unused_tty && !options.defer_noncritical;
+    case STAGE_PRE_RUN_EXEC:
+        return options.pre_run_exec != NULL;
+    default:
+        return 1;
+    }
+}
+
+static int boot_stage_depends_on(int id)
+{
+    // --uniqueid-exec may be on an extra mount or use the environment that
+    // the release sets up, so it runs after them like it does serially
+    if (id == STAGE_SETUP_NETWORKING && options.uniqueid_exec)
+        return boot_stages[id].depends_on | STAGE_BIT(STAGE_MOUNT_FILESYSTEMS) | STAGE_BIT(STAGE_SETUP_ENVIRONMENT);
+
+    return boot_stages[id].depends_on;
+}
+
+static int boot_stage_forkable(int id)
+{
+    // The deferred helper needs the seedrng state from loading the seed, so
+    // it has to be in this process.
+    if (id == STAGE_SEEDRNG && options.defer_noncritical)
+        return 0;
+
+    return boot_stages[id].forkable;
+}
+
+static void run_boot_stages_serially(struct erl_run_info *run_info)
+{
+    for (int id = 0; id < NUM_BOOT_STAGES; id++) {
+        if (boot_stage_enabled(id))
+            TIMELINE_STAGE(boot_stages[id].name, boot_stages[id].run(run_info));
+    }
+}
+
+static void run_boot_stages_in_parallel(struct erl_run_info *run_info)
+{
+    pid_t worker_pids[NUM_BOOT_STAGES] = {0};
+    int timeline_stages[NUM_BOOT_STAGES] = {0};
+    int started = 0;
+    int completed = 0;
+    int running_workers = 0;
+
+    for (int id = 0; id < NUM_BOOT_STAGES; id++) {
+        if (!boot_stage_enabled(id)) {
+            started |= STAGE_BIT(id);
+            completed |= STAGE_BIT(id);
+        }
+    }
+
+    while (completed != STAGE_BIT(NUM_BOOT_STAGES) - 1) {
+        // Start workers for everything that's ready to go
+        for (int id = 0; id < NUM_BOOT_STAGES; id++) {
+            const struct boot_stage *stage = &boot_stages[id];
+            int depends_on = boot_stage_depends_on(id);
+            if ((started & STAGE_BIT(id)) ||
+                    !boot_stage_forkable(id) ||
+                    (depends_on & completed) != depends_on)
+                continue;
+
+            started |= STAGE_BIT(id);
+            timeline_stages[id] = timeline_begin(stage->name);
+            pid_t pid = fork();
+            if (pid == 0) {
+                stage->run(run_info);
+                exit(EXIT_SUCCESS);
+            } else if (pid < 0) {
+                elog(ELOG_WARNING, "Can't fork for %s. Running it serially.", stage->name);
+                stage->run(run_info);
+                timeline_end(timeline_stages[id]);
+                completed |= STAGE_BIT(id);
+            } else {
+                timeline_set_pid(timeline_stages[id], pid);
+                worker_pids[id] = pid;
+                running_workers++;
+            }
+        }
+
+        // Run the next stage that has to be done in this process while
+        // the workers are busy.
+        int next = -1;
+        for (int id = 0; id < NUM_BOOT_STAGES; id++) {
+            int depends_on = boot_stage_depends_on(id);
+            if (!(started & STAGE_BIT(id)) &&
+                    !boot_stage_forkable(id) &&
+                    (depends_on & completed) == depends_on) {
+                next = id;
+                break;
+            }
+        }
+        if (next >= 0) {
+            started |= STAGE_BIT(next);
+            TIMELINE_STAGE(boot_stages[next].name, boot_stages[next].run(run_info));
+            completed |= STAGE_BIT(next);
+        }
+
+        // Collect finished workers. Only block if there's nothing else to do.
+        int block = (next < 0);
+        while (running_workers > 0) {
+            int status;
+            pid_t pid = waitpid(-1, &status, block ? 0 : WNOHANG);
+            if (pid < 0 && errno == EINTR)
+                continue;
+            if (pid <= 0)
+                break;
+
+            for (int id = 0; id < NUM_BOOT_STAGES; id++) {
+                if ((started & STAGE_BIT(id)) &&
+                        !(completed & STAGE_BIT(id)) &&
+                        worker_pids[id] == pid) {
+                    // Keep booting since a partial setup is better than
+                    // none, but make it obvious what went wrong.
+                    if (WIFSIGNALED(status))
+                        elog(ELOG_ERROR, "%s terminated due to signal %d", boot_stages[id].name, WTERMSIG(status));
+                    else if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+                        elog(ELOG_ERROR, "%s exited with status %d", boot_stages[id].name, WEXITSTATUS(status));
+                    timeline_end(timeline_stages[id]);
+                    completed |= STAGE_BIT(id);
+                    running_workers--;
+                    break;
+                }
+            }
+
+            // Stop blocking once something was collected so that stages
+            // waiting on it can start.
+            block = 0;
+        }
+    }
+}
+
+static int defer_rootdisk_symlinks()
+{
+    // Programs run before Erlang and the release itself may use
+    // /dev/rootdisk0pN, so only defer the symlinks when asked to. Extra
+    // mounts often refer to them, so they can't wait in that case.
+    return options.defer_noncritical && options.defer_rootdisk_symlinks &&
+           !(options.extra_mounts && strstr(options.extra_mounts, "/dev/rootdisk"));
+}
+
+static void run_deferred_stages()
+{
+    elog(ELOG_DEBUG, "run_deferred_stages");
+
+    if (defer_rootdisk_symlinks())
+        create_rootdisk_symlinks();
+
+    mount_deferred_filesystems();
+
+    if (options.warn_unused_tty)
+        warn_unused_tty();
+
+    seedrng_save();
+
+    // Let applications know that everything is done
+    if (mkdir(ERLINIT_RUN_DIR, 0755) < 0 && errno != EEXIST) {
+        elog(ELOG_WARNING, "Cannot create %s: %s", ERLINIT_RUN_DIR, strerror(errno));
+        return;
+    }
+
+    FILE *fp = fopen(DEFERRED_READY_PATH, "w");
+    if (fp == NULL) {
+        elog(ELOG_WARNING, "Cannot write %s: %s", DEFERRED_READY_PATH, strerror(errno));
+        return;
+    }
+    fclose(fp);
+}
+
+static void start_deferred_stages()
+{
+    // Run everything that Erlang doesn't need right away in a helper process
+    // so that it can run while the VM boots. If the helper can't be started,
+    // do the work here.
+    int rc = fork_detached();
+    if (rc == 0) {
+        run_deferred_stages();
+        exit(EXIT_SUCCESS);
+    } else if (rc < 0) {
+        run_deferred_stages();
+    }
+}
+
+static void start_async_mounts()
+{
+    // Mount "async" filesystems while the Erlang VM starts. See
+    // publish_mount_status() for how applications find out when they're
+    // ready.
+    int rc = fork_detached();
+    if (rc == 0) {
+        elog(ELOG_DEBUG, "mount_async_filesystems");
+        mount_async_filesystems();
+        exit(EXIT_SUCCESS);
+    } else if (rc < 0) {
+        mount_async_filesystems();
+    }
+}
+
+static void start_code_prewarm(const struct erl_run_info *run_info)
+{
+    if (run_info->boot_path == NULL || run_info->release_base_dir == NULL)
+        return;
+
+    // Reading ahead is asynchronous in the kernel, so one helper process
+    // is enough to queue up all of the .beam files while erlexec starts.
+    if (fork_detached() == 0) {
+        prewarm_boot_modules(run_info->boot_path, run_info->release_base_dir);
+        exit(EXIT_SUCCESS);
+    }
+}
+
+// The child saves what it passed to execvp so that PID 1 can start the
+// Erlang VM again without redoing the boot stages. See --restart-vm.
+#define LAUNCH_RECORD_SIZE (64 * 1024)
+
+struct launch_record {
+    int valid;
+    int argc;
+    int envc;
+    size_t length;
+    char strings[]; // exec path, working directory, argv, then environ
+};
+
+static struct launch_record *launch_record = NULL;
+
+// Written to right before the Erlang VM is launched. See --crash-loop.
+static int vm_launch_fd = -1;
+
+static int launch_record_append(const char *str)
+{
+    size_t len = strlen(str) + 1;
+    if (launch_record->length + len > LAUNCH_RECORD_SIZE - sizeof(struct launch_record))
+        return -1;
+
+    memcpy(launch_record->strings + launch_record->length, str, len);
+    launch_record->length += len;
+    return 0;
+}
+
+static void save_launch_record(const char *exec_path, char **exec_argv)
+{
+    if (!launch_record)
+        return;
+
+    extern char **environ;
+    char cwd[ERLINIT_PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        strcpy(cwd, "/");
+
+    launch_record->length = 0;
+    launch_record->argc = 0;
+    launch_record->envc = 0;
+
+    int rc = launch_record_append(exec_path);
+    rc |= launch_record_append(cwd);
+    for (char **arg = exec_argv; *arg != NULL && rc == 0; arg++) {
+        rc = launch_record_append(*arg);
+        launch_record->argc++;
+    }
+    for (char **env = environ; *env != NULL && rc == 0; env++) {
+        rc = launch_record_append(*env);
+        launch_record->envc++;
+    }
+
+    if (rc < 0)
+        elog(ELOG_WARNING, "Erlang VM arguments too long to support restarting");
+    else
+        launch_record->valid = 1;
+}
+
+static void child()
+{
+    // Locate everything needed to configure the environment
+    // and pass to erlexec.
+    struct erl_run_info run_info;
+    memset(&run_info, 0, sizeof(run_info));
+
+    if (options.parallel_boot)
+        run_boot_stages_in_parallel(&run_info);
+    else
+        run_boot_stages_serially(&run_info);
+
+    // Record the boot timeline while still privileged enough to write to /run
+    timeline_save();
+    timeline_save_trace(1);
+
+    if (options.defer_noncritical)
+        start_deferred_stages();
+
+    if (has_async_mounts())
+        start_async_mounts();
+
+    if (options.prewarm_code)
+        start_code_prewarm(&run_info);
+
+    if (options.readahead_list) {
+        if (options.readahead_record_secs > 0)
+            readahead_start_recording(options.readahead_list, options.readahead_record_secs, &run_info);
+        else
+            readahead_start_replay(options.readahead_list);
+    }
 
     // Optionally drop privileges
     drop_privileges();
@@ -814,10 +1172,16 @@ static void child()
             elog(ELOG_DEBUG, "Arg: '%s'", exec_argv[i]);
     }
 
+    save_launch_record(exec_path, exec_argv);
+
     elog(ELOG_INFO | ELOG_PMSG, "Launching erl...");
     if (options.print_timing)
         elog(ELOG_INFO, "stop");
 
+    // Let PID 1 know to start the --crash-loop timer. The pipe closes on exec.
+    if (vm_launch_fd >= 0 && write(vm_launch_fd, "", 1) < 0)
+        elog(ELOG_WARNING, "Can't start crash loop timer");
+
     execvp(exec_path, exec_argv);
 
     // execvp is not supposed to return
@@ -830,13 +1194,312 @@ static void disable_core_dumps()
         elog(ELOG_WARNING, "Failed to disable core dumps");
 }
 
-static void kill_all()
+// The Erlang VM is tracked with a pidfd when the kernel supports it. The
+// pidfd becomes readable when the VM exits so noticing that doesn't depend
+// on sorting through SIGCHLDs from orphans getting reaped.
+static struct {
+    pid_t pid;
+    int pidfd;
+    int reaped;
+    int wait_status;
+} vm = {0, -1, 0, 0};
+
+static void untrack_vm()
+{
+    if (vm.pidfd >= 0) {
+        event_loop_remove(vm.pidfd);
+        close(vm.pidfd);
+        vm.pidfd = -1;
+    }
+}
+
+static void vm_exit_handler(int fd, void *arg)
+{
+    (void) fd;
+    (void) arg;
+
+    if (!vm.reaped && waitpid(vm.pid, &vm.wait_status, WNOHANG) == vm.pid)
+        vm.reaped = 1;
+    untrack_vm();
+}
+
+static void track_vm(pid_t pid)
+{
+    vm.pid = pid;
+    vm.reaped = 0;
+
+    // pidfd_open can't miss the exit since the VM can't be reaped before
+    // PID 1 waits for it. Without a pidfd, SIGCHLD is all there is.
+    vm.pidfd = open_pidfd(pid);
+    if (vm.pidfd >= 0 && event_loop_add(vm.pidfd, vm_exit_handler, NULL) < 0) {
+        close(vm.pidfd);
+        vm.pidfd = -1;
+    }
+}
+
+static void reap_children(struct erlinit_exit_info *exit_info)
+{
+    // Drain every zombie on each wakeup since one SIGCHLD can stand for
+    // many exits. Applications that run lots of short-lived ports send
+    // orphans here at a high rate, so avoid per-pid work unless debugging.
+    int debug = options.verbose >= ELOG_LEVEL_DEBUG;
+    unsigned int batch = 0;
+    for (;;) {
+        int status;
+        pid_t rc = waitpid(-1, &status, WNOHANG);
+        if (rc <= 0)
+            break;
+
+        if (rc == vm.pid) {
+            vm.wait_status = status;
+            vm.reaped = 1;
+        } else {
+            batch++;
+            if (debug)
+                elog(ELOG_DEBUG, "reaped pid %d", rc);
+        }
+    }
+
+    if (batch == 0)
+        return;
+
+    exit_info->orphans_reaped += batch;
+    exit_info->reap_wakeups++;
+    if (batch > exit_info->max_reap_batch)
+        exit_info->max_reap_batch = batch;
+}
+
+static int ms_until(const struct timespec *deadline)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long ms = (deadline->tv_sec - now.tv_sec) * 1000LL + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    return ms > 0 ? (int) ms : 0;
+}
+
+static void set_flag(int fd, void *arg)
+{
+    (void) fd;
+    *(int *) arg = 1;
+}
+
+static void wait_for_graceful_shutdown(struct erlinit_exit_info *exit_info)
+{
+    clock_gettime(CLOCK_MONOTONIC, &exit_info->shutdown_start);
+    exit_info->graceful_shutdown_ok = 0; // assume failure
+
+    if (options.graceful_shutdown_timeout_ms <= 0)
+        options.graceful_shutdown_timeout_ms = 1;
+    elog(ELOG_DEBUG, "waiting %d ms for graceful shutdown", options.graceful_shutdown_timeout_ms);
+
+    // The deadline is absolute so that reaping orphans and ignored signals
+    // don't extend it. A one-shot timer is preferred. If it's not available,
+    // the time left is recomputed on each wait.
+    struct timespec deadline = exit_info->shutdown_start;
+    deadline.tv_sec += options.graceful_shutdown_timeout_ms / 1000;
+    deadline.tv_nsec += (options.graceful_shutdown_timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    int timed_out = 0;
+    int timer_fd = event_loop_add_timer(options.graceful_shutdown_timeout_ms, 0, set_flag, &timed_out);
+
+    for (;;) {
+        int rc = event_loop_wait(timer_fd >= 0 ? -1 : ms_until(&deadline));
+        if (rc == SIGCHLD)
+            reap_children(exit_info);
+
+        if (vm.reaped) {
+            elog(ELOG_DEBUG, "graceful shutdown detected");
+            exit_info->graceful_shutdown_ok = 1;
+            break;
+        }
+
+        if (timed_out || (rc == 0 && timer_fd < 0)) {
+            // Timeout. Brutal kill our child so that the shutdown process can continue.
+            elog(ELOG_ERROR, "Graceful shutdown timer expired (%d ms). Killing Erlang VM process shortly. Adjust timeout with --graceful-shutdown-timeout option.",
+                 options.graceful_shutdown_timeout_ms);
+            break;
+        } else if (rc < 0 && errno != EINTR) {
+            elog(ELOG_ERROR, "Unexpected errno %d from event loop", errno);
+            break;
+        } else if (rc > 0 && rc != SIGCHLD) {
+            elog(ELOG_WARNING, "Ignoring signal %d while waiting for graceful shutdown", rc);
+        }
+    }
+    if (timer_fd >= 0)
+        event_loop_remove(timer_fd);
+
+    exit_info->wait_status = vm.wait_status;
+    clock_gettime(CLOCK_MONOTONIC, &exit_info->shutdown_complete);
+}
+
+// Shutdown work that doesn't need other processes to be gone. It runs
+// while PID 1 would otherwise be waiting for processes to exit or for
+// filesystems to flush. Everything has to be done before unmount_all since
+// the seed and the shutdown report are saved on filesystems that get
+// unmounted.
+struct shutdown_job {
+    const char *name;
+    void (*run)(const struct erlinit_exit_info *exit_info);
+};
+
+static void job_mini_shutdown_report(const struct erlinit_exit_info *exit_info)
+{
+    log_mini_shutdown_report(exit_info);
+}
+
+static void job_collect_dmesg(const struct erlinit_exit_info *exit_info)
+{
+    (void) exit_info;
+    if (options.shutdown_report)
+        shutdown_report_collect_dmesg();
+}
+
+static void job_seedrng(const struct erlinit_exit_info *exit_info)
+{
+    (void) exit_info;
+    seedrng();
+}
+
+static const struct shutdown_job shutdown_jobs[] = {
+    {"mini_shutdown_report", job_mini_shutdown_report},
+    {"collect_dmesg", job_collect_dmesg},
+    {"seedrng", job_seedrng},
+};
+#define NUM_SHUTDOWN_JOBS (sizeof(shutdown_jobs) / sizeof(shutdown_jobs[0]))
+
+static size_t next_shutdown_job = 0;
+
+static int run_next_shutdown_job(const struct erlinit_exit_info *exit_info)
+{
+    if (next_shutdown_job >= NUM_SHUTDOWN_JOBS)
+        return 0;
+
+    const struct shutdown_job *job = &shutdown_jobs[next_shutdown_job++];
+    TIMELINE_STAGE(job->name, job->run(exit_info));
+    return 1;
+}
+
+static void run_shutdown_jobs(void *arg)
+{
+    while (run_next_shutdown_job(arg))
+        ;
+}
+
+#define KILL_POLL_MS 10
+#define KILL_WAIT_MS 5000
+
+#ifndef PF_KTHREAD
+#define PF_KTHREAD 0x00200000
+#endif
+
+static int pid_filter(const struct dirent *d)
+{
+    return d->d_name[0] >= '1' && d->d_name[0] <= '9';
+}
+
+static int is_running_user_process(int pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return 0;
+
+    char stat[512];
+    size_t len = fread(stat, 1, sizeof(stat) - 1, fp);
+    fclose(fp);
+    stat[len] = '\0';
+
+    // The command name can have spaces and parentheses, so skip to the
+    // last ')'. Zombies are waiting on their parent and kernel threads
+    // don't get killed, so neither counts.
+    const char *fields = strrchr(stat, ')');
+    char state;
+    unsigned int flags;
+    if (!fields || sscanf(fields + 1, " %c %*d %*d %*d %*d %*d %u", &state, &flags) != 2)
+        return 0;
+
+    return state != 'Z' && (flags & PF_KTHREAD) == 0;
+}
+
+static int count_remaining_processes()
+{
+    struct dirent **namelist;
+    int n = scandir("/proc", &namelist, pid_filter, NULL);
+    if (n < 0)
+        return -1;
+
+    int self = getpid();
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        int pid = strtol(namelist[i]->d_name, NULL, 10);
+        if (pid != self && is_running_user_process(pid))
+            count++;
+        free(namelist[i]);
+    }
+    free(namelist);
+    return count;
+}
+
+static void wait_for_processes_to_exit(struct erlinit_exit_info *exit_info, int run_jobs)
+{
+    // Poll until everything has exited rather than always waiting the full
+    // timeout. Orphans are reaped as they exit so that they don't look like
+    // they're still running.
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += options.sigterm_timeout_ms / 1000;
+    deadline.tv_nsec += (options.sigterm_timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    int timed_out = 0;
+    int timer_fd = event_loop_add_timer(options.sigterm_timeout_ms, 0, set_flag, &timed_out);
+
+    for (;;) {
+        reap_children(exit_info);
+
+        int remaining = count_remaining_processes();
+        exit_info->processes_after_sigterm = remaining;
+        if (remaining == 0)
+            break;
+
+        int timeout_ms = timer_fd >= 0 ? KILL_POLL_MS : ms_until(&deadline);
+        if (timed_out || timeout_ms == 0) {
+            elog(ELOG_DEBUG, "Processes still running after SIGTERM: %d", remaining);
+            break;
+        }
+
+        // Do shutdown work rather than wait if there's any left
+        if (run_jobs && run_next_shutdown_job(exit_info))
+            continue;
+
+        if (timeout_ms > KILL_POLL_MS)
+            timeout_ms = KILL_POLL_MS;
+
+        // Returns early on SIGCHLD
+        (void) event_loop_wait(timeout_ms);
+    }
+
+    if (timer_fd >= 0)
+        event_loop_remove(timer_fd);
+}
+
+static void kill_all(struct erlinit_exit_info *exit_info)
 {
     elog(ELOG_DEBUG, "kill_all");
+    clock_gettime(CLOCK_MONOTONIC, &exit_info->kill_start);
 
     // Sync as much as possible to disk before going on the process killing spree to
     // reduce I/O from the processes exiting.
-    sync();
+    exit_info->num_fs_syncs = sync_filesystems(exit_info->fs_syncs, MAX_FS_SYNC_REPORTS, NULL, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &exit_info->kill_synced);
 
     disable_core_dumps();
 
@@ -844,67 +1507,178 @@ static void kill_all()
     elog(ELOG_INFO, "Sending SIGTERM to all processes");
     kill(-1, SIGTERM);
 
-    sleep(1);
+    if (options.sigterm_timeout_ms > 0)
+        wait_for_processes_to_exit(exit_info, 1);
+    clock_gettime(CLOCK_MONOTONIC, &exit_info->kill_termed);
 
     // Brutal kill the stragglers
     elog(ELOG_INFO, "Sending SIGKILL to all processes");
     kill(-1, SIGKILL);
-    sync();
+    sync_filesystems(NULL, 0, run_shutdown_jobs, exit_info);
+    clock_gettime(CLOCK_MONOTONIC, &exit_info->kill_complete);
 }
 
-static void wait_for_graceful_shutdown(pid_t pid, struct erlinit_exit_info *exit_info)
+static void wait_for_killed_processes(struct erlinit_exit_info *exit_info)
 {
-    sigset_t mask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGCHLD);
+    // SIGKILL can't be ignored, but the processes still need to be reaped
+    // and ones in uninterruptible sleep take time to go away. Give up
+    // eventually so that a stuck process can't stop the VM from restarting.
+    int timed_out = 0;
+    int timer_fd = event_loop_add_timer(KILL_WAIT_MS, 0, set_flag, &timed_out);
+    int polls = 0;
 
-    clock_gettime(CLOCK_MONOTONIC, &exit_info->shutdown_start);
-    exit_info->graceful_shutdown_ok = 0; // assume failure
+    for (;;) {
+        reap_children(exit_info);
 
-    // Timeout note: The timer gets reset every time we get a signal
-    // that's ignored. That doesn't appear to happen in practice, but
-    // if it ever did, the total timeout would be longer than you'd expect.
-    struct timespec timeout;
-    if (options.graceful_shutdown_timeout_ms <= 0)
-        options.graceful_shutdown_timeout_ms = 1;
-    timeout.tv_sec = options.graceful_shutdown_timeout_ms / 1000;
-    timeout.tv_nsec = (options.graceful_shutdown_timeout_ms % 1000) * 1000000;
+        int remaining = count_remaining_processes();
+        if (remaining <= 0)
+            break;
 
-    for (;;) {
-        elog(ELOG_DEBUG, "waiting %d ms for graceful shutdown", options.graceful_shutdown_timeout_ms);
-        int rc = sigtimedwait(&mask, NULL, &timeout);
-        if (rc == SIGCHLD) {
-            rc = waitpid(-1, &exit_info->wait_status, WNOHANG);
-            if (rc == pid) {
-                elog(ELOG_DEBUG, "graceful shutdown detected");
-                exit_info->graceful_shutdown_ok = 1;
-                break;
-            } else if (rc < 0) {
-                elog(ELOG_ERROR, "Unexpected error from waitpid %d", errno);
-                break;
-            } else if (rc == 0) {
-                // No child exited
-                elog(ELOG_DEBUG, "Ignoring spurious SIGCHLD");
-            } else {
-                elog(ELOG_DEBUG, "Ignoring SIGCHLD from pid %d", rc);
-            }
-        } else if (rc == 0) {
-            elog(ELOG_ERROR, "Ignoring unexpected return from sigtimedwait");
-        } else if (rc < 0) {
-            if (errno == EAGAIN) {
-                // Timeout. Brutal kill our child so that the shutdown process can continue.
-                elog(ELOG_ERROR, "Graceful shutdown timer expired (%d ms). Killing Erlang VM process shortly. Adjust timeout with --graceful-shutdown-timeout option.",
-                     options.graceful_shutdown_timeout_ms);
-                break;
-            } else if (errno != EINTR) {
-                elog(ELOG_ERROR, "Unexpected errno %d from sigtimedwait", errno);
-                break;
-            }
-        } else if (rc > 0) {
-            elog(ELOG_WARNING, "Ignoring signal %d while waiting for graceful shutdown", rc);
+        if (timed_out || (timer_fd < 0 && polls++ >= KILL_WAIT_MS / KILL_POLL_MS)) {
+            elog(ELOG_WARNING, "Processes still running after SIGKILL: %d", remaining);
+            break;
         }
+
+        // Returns early on SIGCHLD
+        (void) event_loop_wait(KILL_POLL_MS);
     }
-    clock_gettime(CLOCK_MONOTONIC, &exit_info->shutdown_complete);
+
+    if (timer_fd >= 0)
+        event_loop_remove(timer_fd);
+}
+
+static void kill_stragglers(struct erlinit_exit_info *exit_info)
+{
+    // Like kill_all, but without the shutdown work since the device stays up
+    elog(ELOG_INFO, "Sending SIGTERM to all processes");
+    kill(-1, SIGTERM);
+
+    if (options.sigterm_timeout_ms > 0)
+        wait_for_processes_to_exit(exit_info, 0);
+
+    elog(ELOG_INFO, "Sending SIGKILL to all processes");
+    kill(-1, SIGKILL);
+
+    // The new VM shouldn't start until the old processes are gone
+    wait_for_killed_processes(exit_info);
+}
+
+// Restart times for the last --restart-vm restarts
+static struct timespec *vm_restart_times = NULL;
+
+static int vm_restart_allowed(const struct erlinit_exit_info *exit_info)
+{
+    if (options.vm_restart_limit <= 0 || !launch_record || !launch_record->valid)
+        return 0;
+
+    if (exit_info->vm_restarts < options.vm_restart_limit)
+        return 1;
+
+    // Out of restarts if the oldest one is still inside the window
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const struct timespec *oldest = &vm_restart_times[exit_info->vm_restarts % options.vm_restart_limit];
+    return now.tv_sec - oldest->tv_sec >= options.vm_restart_window_minutes * 60;
+}
+
+static void relaunch_vm()
+{
+    // Everything was resolved the first time, so this only needs to
+    // restore the environment and exec.
+    char *str = launch_record->strings;
+    char *exec_path = str;
+    str += strlen(str) + 1;
+    char *cwd = str;
+    str += strlen(str) + 1;
+
+    char **exec_argv = malloc((launch_record->argc + 1) * sizeof(char *));
+    char **envp = malloc((launch_record->envc + 1) * sizeof(char *));
+    if (!exec_argv || !envp)
+        fatal("Out of memory restarting the Erlang VM");
+
+    for (int i = 0; i < launch_record->argc; i++) {
+        exec_argv[i] = str;
+        str += strlen(str) + 1;
+    }
+    exec_argv[launch_record->argc] = NULL;
+    for (int i = 0; i < launch_record->envc; i++) {
+        envp[i] = str;
+        str += strlen(str) + 1;
+    }
+    envp[launch_record->envc] = NULL;
+
+    extern char **environ;
+    environ = envp;
+
+    OK_OR_WARN(chdir(cwd), "Cannot change to %s", cwd);
+    drop_privileges();
+
+    elog(ELOG_INFO | ELOG_PMSG, "Launching erl...");
+    execvp(exec_path, exec_argv);
+
+    // execvp is not supposed to return
+    fatal("execvp failed to run %s: %s", exec_path, strerror(errno));
+}
+
+static pid_t restart_vm(struct erlinit_exit_info *exit_info, const sigset_t *orig_mask)
+{
+    if (WIFSIGNALED(vm.wait_status))
+        elog(ELOG_ERROR, "Erlang terminated due to signal %d. Restarting it.", WTERMSIG(vm.wait_status));
+    else
+        elog(ELOG_ERROR, "Erlang VM exited. Restarting it.");
+
+    clock_gettime(CLOCK_MONOTONIC, &vm_restart_times[exit_info->vm_restarts % options.vm_restart_limit]);
+    exit_info->vm_restarts++;
+
+    // Anything the old VM started would confuse the new one
+    TIMELINE_STAGE("kill_stragglers", kill_stragglers(exit_info));
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (sigprocmask(SIG_SETMASK, orig_mask, NULL) < 0)
+            fatal("sigprocmask(SIG_SETMASK) failed");
+        event_loop_close();
+
+        relaunch_vm();
+        exit(1);
+    } else if (pid < 0) {
+        elog(ELOG_ERROR, "Can't restart the Erlang VM: %s", strerror(errno));
+    }
+    return pid;
+}
+
+// Set once the Erlang VM has run longer than --crash-loop allows for a crash
+static int vm_survived_launch = 0;
+
+static void crash_loop_timer_handler(int fd, void *arg)
+{
+    (void) arg;
+
+    event_loop_remove(fd);
+    vm_survived_launch = 1;
+    crash_loop_reset();
+}
+
+static void crash_loop_launch_handler(int fd, void *arg)
+{
+    (void) arg;
+
+    // The child writes a byte right before it execs the Erlang VM. EOF
+    // means that it exited first.
+    char c;
+    ssize_t amount = read(fd, &c, 1);
+    event_loop_remove(fd);
+    close(fd);
+
+    if (amount == 1 &&
+        event_loop_add_timer(options.crash_loop_seconds * 1000, 0, crash_loop_timer_handler, NULL) < 0)
+        elog(ELOG_WARNING, "Can't start crash loop timer");
+}
+
+static void check_crash_loop(struct erlinit_exit_info *exit_info)
+{
+    if (crash_loop_record_crash())
+        exit_info->desired_reboot_cmd = LINUX_REBOOT_CMD_HALT;
 }
 
 static void read_reboot_args(char *args, size_t max_length)
@@ -938,10 +1712,28 @@ static void fork_and_wait(struct erlinit_exit_info *exit_info)
     sigaddset(&mask, SIGTERM);
 
     // Block signals from the child process so that they're
-    // handled by sigtimedwait.
+    // handled by the event loop.
     if (sigprocmask(SIG_BLOCK, &mask, &orig_mask) < 0)
         fatal("sigprocmask(SIG_BLOCK) failed");
 
+    if (event_loop_init(&mask) < 0)
+        fatal("Cannot start event loop: %s", strerror(errno));
+
+    if (options.vm_restart_limit > 0) {
+        launch_record = mmap(NULL, LAUNCH_RECORD_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        vm_restart_times = calloc(options.vm_restart_limit, sizeof(struct timespec));
+        if (launch_record == MAP_FAILED || !vm_restart_times) {
+            elog(ELOG_WARNING, "Can't allocate memory for --restart-vm");
+            launch_record = NULL;
+        }
+    }
+
+    // The crash loop timer starts when the Erlang VM is launched rather
+    // than at the fork so that slow boot stages don't count against it.
+    int launch_pipe[2] = {-1, -1};
+    if (options.crash_loop_limit > 0 && pipe2(launch_pipe, O_CLOEXEC) < 0)
+        elog(ELOG_WARNING, "Can't start crash loop timer: %s", strerror(errno));
+
     // Do most of the work in a child process so that if it
     // crashes, we can handle the crash.
     pid_t pid = fork();
@@ -949,54 +1741,93 @@ static void fork_and_wait(struct erlinit_exit_info *exit_info)
         // Unblock signals in the child
         if (sigprocmask(SIG_SETMASK, &orig_mask, NULL) < 0)
             fatal("sigprocmask(SIG_SETMASK) failed");
+        event_loop_close();
+
+        if (launch_pipe[0] >= 0)
+            close(launch_pipe[0]);
+        vm_launch_fd = launch_pipe[1];
 
         child();
         exit(1);
     }
 
+    // Track the Erlang VM's lifetime from the PID 1 side
+    timeline_forked();
+    if (launch_pipe[0] >= 0) {
+        close(launch_pipe[1]);
+        if (event_loop_add(launch_pipe[0], crash_loop_launch_handler, NULL) < 0) {
+            elog(ELOG_WARNING, "Can't start crash loop timer");
+            close(launch_pipe[0]);
+        }
+    }
+
+    int vm_stage = timeline_begin("erlang");
+    timeline_set_pid(vm_stage, pid);
+    track_vm(pid);
+
     exit_info->wait_status = 0;
     for (;;) {
-        int rc = sigwaitinfo(&mask, NULL);
-        if (rc == SIGCHLD) {
-            // Child process exited
-            //   Reap all processes that exited
-            //   If our immediate child exited, exit too
-            do {
-                rc = waitpid(-1, &exit_info->wait_status, WNOHANG);
-                if (rc == pid)
-                    goto prepare_to_exit;
-                else if (rc > 0)
-                    elog(ELOG_DEBUG, "reaped pid %d", rc);
-            } while (rc > 0);
+        int rc = event_loop_wait(-1);
+        if (rc == SIGCHLD)
+            reap_children(exit_info);
+
+        if (vm.reaped) {
+            if (vm_restart_allowed(exit_info)) {
+                pid_t new_pid = restart_vm(exit_info, &orig_mask);
+                if (new_pid > 0) {
+                    untrack_vm();
+                    timeline_end(vm_stage);
+                    vm_stage = timeline_begin("erlang");
+                    timeline_set_pid(vm_stage, new_pid);
+                    track_vm(new_pid);
+                    continue;
+                }
+            }
+
+            // Our immediate child exited, so exit too
+            exit_info->wait_status = vm.wait_status;
+            goto prepare_to_exit;
+        }
+
+        if (rc == 0 || rc == SIGCHLD) {
+            // Only orphans or non-signal events
+            continue;
         } else if (rc < 0) {
             // An error occurred.
-            elog(ELOG_DEBUG, "sigwaitinfo->errno %d", errno);
+            elog(ELOG_DEBUG, "event_loop_wait->errno %d", errno);
             if (errno != EINTR)
-                fatal("Unexpected error from sigwaitinfo: %d", errno);
+                fatal("Unexpected error from event loop: %d", errno);
         } else if (rc == SIGPWR || rc == SIGUSR1) {
             // Halt request
             elog(ELOG_INFO, "Halt requested");
             exit_info->desired_reboot_cmd = LINUX_REBOOT_CMD_HALT;
-            wait_for_graceful_shutdown(pid, exit_info);
+            TIMELINE_STAGE("wait_for_graceful_shutdown", wait_for_graceful_shutdown(exit_info));
             break;
         } else if (rc == SIGTERM) {
             // Reboot request
             elog(ELOG_INFO, "Reboot requested");
             read_reboot_args(exit_info->reboot_args, sizeof(exit_info->reboot_args));
             exit_info->desired_reboot_cmd = exit_info->reboot_args[0] == '\0' ? LINUX_REBOOT_CMD_RESTART : LINUX_REBOOT_CMD_RESTART2;
-            wait_for_graceful_shutdown(pid, exit_info);
+            TIMELINE_STAGE("wait_for_graceful_shutdown", wait_for_graceful_shutdown(exit_info));
             break;
         } else if (rc == SIGUSR2) {
             elog(ELOG_INFO, "Power off requested");
             exit_info->desired_reboot_cmd = LINUX_REBOOT_CMD_POWER_OFF;
-            wait_for_graceful_shutdown(pid, exit_info);
+            TIMELINE_STAGE("wait_for_graceful_shutdown", wait_for_graceful_shutdown(exit_info));
             break;
         } else {
-            elog(ELOG_WARNING, "sigwaitinfo unexpected rc=%d", rc);
+            elog(ELOG_WARNING, "event_loop_wait unexpected rc=%d", rc);
         }
     }
 
 prepare_to_exit:
+    untrack_vm();
+    timeline_end(vm_stage);
+
+    if (exit_info->orphans_reaped > 0)
+        elog(ELOG_DEBUG, "Reaped %lu orphans in %lu wakeups (max %u at once)",
+             exit_info->orphans_reaped, exit_info->reap_wakeups, exit_info->max_reap_batch);
+
     // Check if this was a clean exit.
     if (exit_info->desired_reboot_cmd != 0) {
         // Intentional exit since reboot/poweroff/halt was called.
@@ -1012,25 +1843,113 @@ prepare_to_exit:
             elog(ELOG_ERROR, "Erlang terminated due to signal %d", WTERMSIG(exit_info->wait_status));
         else
             elog(ELOG_INFO, "Erlang VM exited");
+
+        if (options.crash_loop_limit > 0 && !vm_survived_launch)
+            check_crash_loop(exit_info);
     }
 }
 
 
 /* See reboot(2) for details about the reboot command with arguments (arg is a NULL-terminated string)*/
-#include <sys/syscall.h>
 static inline int reboot_with_args(int cmd, const void *arg) {
     return (int) syscall(SYS_reboot, LINUX_REBOOT_MAGIC1, LINUX_REBOOT_MAGIC2, cmd, arg);
 }
 
+static char *prefix_path(const char *root, const char *path)
+{
+    char *result = NULL;
+    erlinit_asprintf(&result, "%s%s", root, path);
+    return result;
+}
+
+static char *prefix_search_path(const char *root, const char *search_path)
+{
+    char *search_path_copy = strdup(search_path);
+    char *result = NULL;
+    for (char *path = strtok(search_path_copy, ":"); path; path = strtok(NULL, ":")) {
+        if (result)
+            erlinit_asprintf(&result, "%s:%s%s", result, root, path);
+        else
+            erlinit_asprintf(&result, "%s%s", root, path);
+    }
+    free(search_path_copy);
+    return result ? result : strdup("");
+}
+
+static int resolve_release(int argc, char *argv[])
+{
+    // Usage: erlinit --resolve-release <root> [options]
+    //
+    // Find the release in a firmware staging directory the same way as on
+    // boot and save the results to the path given by --release-manifest.
+    char *root = strdup(argv[2]);
+    size_t root_len = strlen(root);
+    while (root_len > 0 && root[root_len - 1] == '/')
+        root[--root_len] = '\0';
+
+    options.resolve_release = root;
+
+    argv[2] = argv[0];
+    argc -= 2;
+    argv += 2;
+
+    char *config_path = prefix_path(root, "/etc/erlinit.config");
+    static int merged_argc;
+    static char *merged_argv[MAX_ARGC];
+    merge_config(config_path, argc, argv, &merged_argc, merged_argv);
+    free(config_path);
+
+    parse_args(merged_argc, merged_argv);
+
+    if (options.release_manifest == NULL) {
+        elog(ELOG_ERROR, "Specify where to save the manifest with --release-manifest");
+        return EXIT_FAILURE;
+    }
+
+    // Search paths under the staging directory, but remember the originals
+    // since they're part of the manifest.
+    char *release_search_path = options.release_search_path;
+    char *boot_path = options.boot_path;
+
+    erlang_root_dir = prefix_path(root, ERLANG_ROOT_DIR);
+    options.release_search_path = prefix_search_path(root,
+                                                     release_search_path ? release_search_path : DEFAULT_RELEASE_ROOT_DIR);
+    if (boot_path && boot_path[0] == '/')
+        options.boot_path = prefix_path(root, boot_path);
+
+    struct erl_run_info run_info;
+    memset(&run_info, 0, sizeof(run_info));
+    find_release(&run_info);
+    find_erts_directory(run_info.erts_version, run_info.release_base_dir, &run_info.erts_dir);
+    if (run_info.releases_version_dir == NULL)
+        return EXIT_FAILURE;
+
+    options.release_search_path = release_search_path;
+    options.boot_path = boot_path;
+    run_info_strip_prefix(&run_info, root);
+
+    char *manifest_path = prefix_path(root, options.release_manifest);
+    int rc = release_manifest_save(manifest_path, &run_info);
+    free(manifest_path);
+
+    return rc < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 int main(int argc, char *argv[])
 {
+    timeline_init();
+    log_init();
+
+    if (argc >= 3 && strcmp(argv[1], "--resolve-release") == 0)
+        return resolve_release(argc, argv);
+
     if (getpid() != 1)
         fatal("Refusing to run since not pid 1");
 
     // Merge the config file and the command line arguments
     static int merged_argc;
     static char *merged_argv[MAX_ARGC];
-    merge_config(argc, argv, &merged_argc, merged_argv);
+    merge_config("/etc/erlinit.config", argc, argv, &merged_argc, merged_argv);
 
     parse_args(merged_argc, merged_argv);
 
@@ -1046,45 +1965,58 @@ int main(int argc, char *argv[])
 
     // Set up experimental writable file system overlay
     if (options.x_pivot_root_on_overlayfs)
-        pivot_root_on_overlayfs();
+        TIMELINE_STAGE("pivot_root_on_overlayfs", pivot_root_on_overlayfs());
 
     // Mount /dev, /proc and /sys
-    setup_pseudo_filesystems();
+    TIMELINE_STAGE("setup_pseudo_filesystems", setup_pseudo_filesystems());
 
     // Create symlinks for partitions on the drive containing the
     // root filesystem.
-    create_rootdisk_symlinks();
+    if (!defer_rootdisk_symlinks())
+        TIMELINE_STAGE("create_rootdisk_symlinks", create_rootdisk_symlinks());
 
     // Fix the terminal settings so output goes to the right
     // terminal and the CTRL keys work in the shell..
-    set_ctty();
+    TIMELINE_STAGE("set_ctty", set_ctty());
 
     // Set resource limits. This has to be done before fork.
-    create_limits();
+    TIMELINE_STAGE("create_limits", create_limits());
 
     struct erlinit_exit_info exit_info;
     fork_and_wait(&exit_info);
 
     // If the user specified a command to run on an unexpected exit, run it.
     if (options.run_on_exit && !exit_info.is_intentional_exit)
-        run_cmd(options.run_on_exit);
+        run_cmd(options.run_on_exit, 0);
 
-    // Exit everything that's still running.
-    kill_all();
+    // Exit everything that's still running. This also runs the shutdown jobs
+    // (mini shutdown report, dmesg collection and saving the random number
+    // seed) while processes exit and filesystems flush.
+    TIMELINE_STAGE("kill_all", kill_all(&exit_info));
+    run_shutdown_jobs(&exit_info);
 
     // Dump state for post-mortem analysis of why the power off or reboot occurred.
-    log_mini_shutdown_report(&exit_info);
+    // This needs the kill_all timing.
     if (options.shutdown_report)
-        shutdown_report_create(options.shutdown_report, &exit_info);
+        TIMELINE_STAGE("shutdown_report", shutdown_report_create(options.shutdown_report, &exit_info));
 
-    // Save the seed for the random number generator (failures ignored)
-    seedrng();
+    // The trace file can't be written after its filesystem is unmounted, so
+    // save it now and report the last two stages via pmsg.
+    timeline_save_trace(0);
 
     // Unmount almost everything.
+    int unmount_stage = timeline_begin("unmount_all");
     unmount_all();
+    timeline_end(unmount_stage);
 
     // Sync just to be safe.
+    int sync_stage = timeline_begin("sync");
     sync();
+    timeline_end(sync_stage);
+
+    if (options.trace_file)
+        elog(ELOG_PMSG_ONLY, "Shutdown trace: unmount_all %lld us, sync %lld us",
+             timeline_duration_us(unmount_stage), timeline_duration_us(sync_stage));
 
     // See if the user wants us to halt or poweroff on an "unintentional" exit
     if (!exit_info.is_intentional_exit &&
@@ -10,6 +10,9 @@
 #ifndef ERLINIT_H
 #define ERLINIT_H
 
+#include <signal.h>
+#include <stdio.h>
+#include <sys/types.h>
 #include <time.h>
 
 #define PROGRAM_NAME "erlinit"
@@ -29,11 +32,10 @@
 #define ERLANG_ERTS_LIB_DIR ERLANG_ROOT_DIR "/lib"
 
 #define DEFAULT_RELEASE_ROOT_DIR "/srv/erlang"
+#define DEFAULT_CRASH_LOOP_FILE "/root/erlinit_crash_loop"
 
-// This is the maximum number of mounted filesystems that
-// is expected in a running system. It is used on shutdown
-// when trying to unmount everything gracefully.
-#define MAX_MOUNTS 32
+// Runtime state shared with the Erlang side. /run is mounted by erlinit.
+#define ERLINIT_RUN_DIR "/run/erlinit"
 
 #define MAX_ARGC 64
 
@@ -89,16 +91,80 @@ struct erlinit_options {
     int uid;
     int gid;
     int graceful_shutdown_timeout_ms;
+    int sigterm_timeout_ms;
     int update_clock;
     char *tty_options;
     char *shutdown_report;
     char *limits;
     int x_pivot_root_on_overlayfs;
     char *core_pattern;
+    char *trace_file;
+    int parallel_boot;
+    int defer_noncritical;
+    int defer_rootdisk_symlinks;   // Also defer the /dev/rootdisk0 symlinks (needs --defer-noncritical)
+    char *release_cache;
+    char *release_manifest;
+    char *resolve_release; // Staging directory when not running as PID 1
+    int prewarm_code;
+    char *readahead_list;
+    int readahead_record_secs;
+    int vm_restart_limit;          // Max Erlang VM restarts in the window (0 to reboot instead)
+    int vm_restart_window_minutes;
+    int crash_loop_limit;          // Quick crashes in a row before giving up (0 to disable)
+    int crash_loop_seconds;        // Exiting sooner than this after launch is a quick crash
+    char *crash_loop_file;
+    char *crash_loop_release_path;
+    int cmd_timeout_ms;            // Kill --uniqueid-exec and --pre-run-exec after this long (0 to wait forever)
+    int mount_wait_ms;             // Wait this long for each -m source device to appear
+    char *tmpfs;                   // --tmpfs entries separated by ';'
+    char *zram;                    // --zram entries separated by ';'
 };
 
 extern struct erlinit_options options;
 
+struct erl_run_info {
+    // This is the base directory for the release
+    // e.g., <base>/[release_name]
+    // The release_name directory is optional and may not be included. It
+    // is normally omitted by Nerves.
+    char *release_base_dir;
+
+    // This is the directory containing the release start scripts
+    // e.g., <release_base_dir>/releases/<version>
+    char *releases_version_dir;
+
+    // This is the search path for the .beams created by
+    // Elixir's Protocol consolidation code.
+    // e.g., <release_base_dir>/lib/*/consolidated
+    char *consolidated_protocols_path;
+
+    // This is the name of the release. It could be empty if there's
+    // no name and this is typical for Nerves.
+    char *release_name;
+
+    // ERTS version if specified by start_erl.data
+    char *erts_version;
+
+    // The directory containing ERTS
+    char *erts_dir;
+
+    // This is the path to the .boot file
+    char *boot_path;
+
+    // This is the path to sys.config
+    char *sys_config;
+
+    // This is the path to vm.args
+    char *vmargs_path;
+};
+
+#define MAX_FS_SYNC_REPORTS 16
+
+struct fs_sync_report {
+    char target[64];
+    long long duration_us; // -1 if the flush failed
+};
+
 struct erlinit_exit_info {
     int is_intentional_exit;
     int desired_reboot_cmd;
@@ -107,6 +173,25 @@ struct erlinit_exit_info {
     struct timespec shutdown_complete;
     int graceful_shutdown_ok;
     char reboot_args[32];
+
+    // Time spent in each kill_all step
+    struct timespec kill_start;
+    struct timespec kill_synced;
+    struct timespec kill_termed;
+    struct timespec kill_complete;
+    int processes_after_sigterm;
+
+    // Per-filesystem flush times from before SIGTERM
+    struct fs_sync_report fs_syncs[MAX_FS_SYNC_REPORTS];
+    int num_fs_syncs;
+
+    // Orphan reaping counters
+    unsigned long orphans_reaped;
+    unsigned long reap_wakeups;
+    unsigned int max_reap_batch;
+
+    // Times the Erlang VM was restarted in place
+    int vm_restarts;
 };
 
 // Logging functions
@@ -114,12 +199,28 @@ void elog(int severity, const char *fmt, ...)
     __attribute__((format(printf, 2, 3)));
 void fatal(const char *fmt, ...)
 	__attribute__((format(printf, 1, 2), noreturn));
+void log_init(void);
+void log_reopen_sinks(void);
+void log_report(FILE *fp);
 
 #define OK_OR_FATAL(WORK, MSG, ...) do { if ((WORK) < 0) fatal(MSG, ## __VA_ARGS__); } while (0)
 #define OK_OR_WARN(WORK, MSG, ...) do { if ((WORK) < 0) elog(ELOG_WARNING, MSG, ## __VA_ARGS__); } while (0)
 
+// Boot timeline (--print-timing and --trace-file)
+void timeline_init(void);
+int timeline_begin(const char *stage);
+int timeline_begin_detail(const char *stage, const char *detail);
+void timeline_set_pid(int stage, pid_t pid);
+void timeline_end(int stage);
+long long timeline_duration_us(int stage);
+void timeline_forked(void);
+void timeline_save(void);
+void timeline_save_trace(int new_trace);
+
+#define TIMELINE_STAGE(NAME, WORK) do { int stage_ = timeline_begin(NAME); WORK; timeline_end(stage_); } while (0)
+
 // Configuration loading
-void merge_config(int argc, char *argv[], int *merged_argc, char **merged_argv);
+void merge_config(const char *config_path, int argc, char *argv[], int *merged_argc, char **merged_argv);
 
 // Argument parsing
 void parse_args(int argc, char *argv[]);
@@ -133,7 +234,18 @@ void pivot_root_on_overlayfs(void);
 void setup_pseudo_filesystems(void);
 void create_rootdisk_symlinks(void);
 void mount_filesystems(void);
+void mount_deferred_filesystems(void);
+int has_async_mounts(void);
+void mount_async_filesystems(void);
 void unmount_all(void);
+void tmpfs_options(const char *name, const char *defaults, char *result, size_t len);
+
+// zram (--zram)
+void setup_zram_swap(void);
+int has_zram(const char *use);
+int mount_zram(const char *use, const char *target, unsigned long flags);
+int sync_filesystems(struct fs_sync_report *reports, int max_reports,
+                     void (*while_flushing)(void *arg), void *arg);
 
 // Limits
 void create_limits(void);
@@ -144,16 +256,56 @@ void warn_unused_tty(void);
 
 // External commands
 int system_cmd(const char *cmd, char *output_buffer, int length);
+int run_cmd(const char *cmd, int timeout_ms);
+int fork_detached(void);
+
+// PID 1 event loop
+typedef void (*event_handler)(int fd, void *arg);
+int event_loop_init(const sigset_t *signals);
+void event_loop_close(void);
+int event_loop_add(int fd, event_handler handler, void *arg);
+int event_loop_add_timer(int ms, int periodic, event_handler handler, void *arg);
+void event_loop_remove(int fd);
+int event_loop_wait(int timeout_ms);
+
+// Release cache and manifest
+int release_cache_load(const char *path, struct erl_run_info *run_info);
+void release_cache_save(const char *path, const struct erl_run_info *run_info);
+int release_manifest_load(const char *path, struct erl_run_info *run_info);
+int release_manifest_save(const char *path, const struct erl_run_info *run_info);
+void run_info_strip_prefix(struct erl_run_info *run_info, const char *prefix);
+void free_run_info(struct erl_run_info *run_info);
+void release_check_format(char *line, size_t len, const char *path);
+int release_check_matches(const char *check);
+
+// Boot script
+void prewarm_boot_modules(const char *boot_path, const char *release_base_dir);
+
+// Readahead
+int readahead_file(const char *path);
+void readahead_start_replay(const char *list_path);
+void readahead_start_recording(const char *list_path, int seconds, const struct erl_run_info *run_info);
 
 // Shutdown report
+void shutdown_report_collect_dmesg(void);
 void shutdown_report_create(const char *path, const struct erlinit_exit_info *info);
 void log_mini_shutdown_report(const struct erlinit_exit_info *exit_info);
 
+// Crash loop detection (--crash-loop)
+int crash_loop_use_fallback(void);
+int crash_loop_record_crash(void);
+void crash_loop_reset(void);
+
 // seedrng
 int seedrng(void);
+int seedrng_load(void);
+int seedrng_save(void);
 
 // Utility functions
 void trim_whitespace(char *s);
+int open_pidfd(pid_t pid);
+unsigned long long total_ram(void);
+int parse_size(const char *str, unsigned long long *bytes);
 
 #ifdef __APPLE__
 #include "compat.h"
@@ -0,0 +1,230 @@
+// SPDX-FileCopyrightText: 2026 Frank Hunleth
+//
+// SPDX-License-Identifier: MIT
+//
+
+#include "erlinit.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef __APPLE__
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#endif
+
+// PID 1's main loop. Signals are received through a signalfd so that they
+// can be waited on along with file descriptors and timers in one epoll
+// call. This makes it possible to add work to PID 1 without more processes
+// or polling.
+
+#ifndef __APPLE__
+#define MAX_EVENT_SOURCES 8
+
+struct event_source {
+    int fd;
+    int is_timer;
+    event_handler handler;
+    void *arg;
+};
+
+static struct event_source sources[MAX_EVENT_SOURCES];
+static int num_sources = 0;
+
+static int epoll_fd = -1;
+static int signal_fd = -1;
+
+int event_loop_init(const sigset_t *signals)
+{
+    // The signals must already be blocked for signalfd to get them
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+        return -1;
+
+    signal_fd = signalfd(-1, signals, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (signal_fd < 0)
+        return -1;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = signal_fd;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev);
+}
+
+void event_loop_close()
+{
+    for (int i = 0; i < num_sources; i++) {
+        if (sources[i].is_timer)
+            close(sources[i].fd);
+    }
+    num_sources = 0;
+
+    if (signal_fd >= 0)
+        close(signal_fd);
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+    signal_fd = -1;
+    epoll_fd = -1;
+}
+
+static int add_source(int fd, int is_timer, event_handler handler, void *arg)
+{
+    if (num_sources == MAX_EVENT_SOURCES) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        return -1;
+
+    struct event_source *source = &sources[num_sources++];
+    source->fd = fd;
+    source->is_timer = is_timer;
+    source->handler = handler;
+    source->arg = arg;
+    return fd;
+}
+
+int event_loop_add(int fd, event_handler handler, void *arg)
+{
+    return add_source(fd, 0, handler, arg);
+}
+
+int event_loop_add_timer(int ms, int periodic, event_handler handler, void *arg)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (fd < 0)
+        return -1;
+
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = ms / 1000;
+    spec.it_value.tv_nsec = (ms % 1000) * 1000000;
+    if (ms <= 0)
+        spec.it_value.tv_nsec = 1; // Zero would disarm the timer
+    if (periodic)
+        spec.it_interval = spec.it_value;
+
+    if (timerfd_settime(fd, 0, &spec, NULL) < 0 || add_source(fd, 1, handler, arg) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void event_loop_remove(int fd)
+{
+    for (int i = 0; i < num_sources; i++) {
+        if (sources[i].fd == fd) {
+            (void) epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            if (sources[i].is_timer)
+                close(fd);
+            sources[i] = sources[--num_sources];
+            return;
+        }
+    }
+}
+
+static void dispatch(int fd)
+{
+    for (int i = 0; i < num_sources; i++) {
+        struct event_source *source = &sources[i];
+        if (source->fd != fd)
+            continue;
+
+        if (source->is_timer) {
+            uint64_t expirations;
+            if (read(fd, &expirations, sizeof(expirations)) < 0)
+                return;
+        }
+
+        // The handler may remove sources, so don't touch them afterwards
+        source->handler(fd, source->arg);
+        return;
+    }
+}
+
+int event_loop_wait(int timeout_ms)
+{
+    struct epoll_event events[MAX_EVENT_SOURCES + 1];
+    int count = epoll_wait(epoll_fd, events, MAX_EVENT_SOURCES + 1, timeout_ms);
+    if (count < 0)
+        return -1;
+
+    int signo = 0;
+    for (int i = 0; i < count; i++) {
+        int fd = events[i].data.fd;
+        if (fd == signal_fd) {
+            // Handle one signal at a time. Others are reported on the
+            // next call.
+            struct signalfd_siginfo info;
+            if (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+                signo = info.ssi_signo;
+        } else {
+            dispatch(fd);
+        }
+    }
+    return signo;
+}
+#else
+// MacOS doesn't have signalfd, epoll or timerfd, so only support signals
+// for running the tests.
+static sigset_t loop_signals;
+
+int event_loop_init(const sigset_t *signals)
+{
+    loop_signals = *signals;
+    return 0;
+}
+
+void event_loop_close()
+{
+}
+
+int event_loop_add(int fd, event_handler handler, void *arg)
+{
+    (void) fd;
+    (void) handler;
+    (void) arg;
+    errno = ENOSYS;
+    return -1;
+}
+
+int event_loop_add_timer(int ms, int periodic, event_handler handler, void *arg)
+{
+    (void) ms;
+    (void) periodic;
+    (void) handler;
+    (void) arg;
+    errno = ENOSYS;
+    return -1;
+}
+
+void event_loop_remove(int fd)
+{
+    (void) fd;
+}
+
+int event_loop_wait(int timeout_ms)
+{
+    if (timeout_ms < 0)
+        return sigwaitinfo(&loop_signals, NULL);
+
+    struct timespec timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
+    int rc = sigtimedwait(&loop_signals, NULL, &timeout);
+    if (rc < 0 && errno == EAGAIN)
+        return 0;
+    return rc;
+}
+#endif
@@ -7,14 +7,25 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifndef __APPLE__
+#include <linux/netlink.h>
+#endif
+
 static unsigned long str_to_mountflags(char *s)
 {
     unsigned long flags = 0;
@@ -48,6 +59,11 @@ static unsigned long str_to_mountflags(char *s)
             flags |= MS_STRICTATIME;
         else if (strcmp(flag, "sync") == 0)
             flags |= MS_SYNCHRONOUS;
+        else if (strcmp(flag, "defer") == 0 || strcmp(flag, "async") == 0 ||
+                 strncmp(flag, "wait=", 5) == 0)
+            ; // Not a kernel flag. See mount_extra_filesystems().
+        else if (strcmp(flag, "nofail") == 0)
+            ; // Only for mount(8). erlinit doesn't fail on mount errors.
         else
             elog(ELOG_WARNING, "Unrecognized filesystem mount flag: %s", flag);
 
@@ -56,6 +72,18 @@ static unsigned long str_to_mountflags(char *s)
     return flags;
 }
 
+static int mount_overlay_upper_on_zram()
+{
+    // /sys isn't mounted yet, but it's needed to set up zram
+    if (!has_zram("overlay") ||
+            mount("sysfs", "/sys", "sysfs", MS_NOEXEC | MS_NOSUID | MS_NODEV, NULL) < 0)
+        return 0;
+
+    int rc = mount_zram("overlay", "/mnt", 0);
+    OK_OR_WARN(umount("/sys"), "Cannot unmount /sys");
+    return rc == 0;
+}
+
 int pivot_root(const char *new_root, const char *put_old);
 void pivot_root_on_overlayfs()
 {
@@ -64,10 +92,14 @@ void pivot_root_on_overlayfs()
     // Setup an overlay filesystem for the rootfs so that the official contents
     // are protected in a read-only fs, but we can still update files when
     // debugging.
-    if (mount("", "/mnt", "tmpfs", 0, "size=10%") < 0) {
-        elog(ELOG_ERROR, "Could not mount tmpfs in /mnt: %s\n"
-             "Check that tmpfs support is enabled in the kernel config.", strerror(errno));
-        return;
+    if (!mount_overlay_upper_on_zram()) {
+        char tmpfs_opts[256];
+        tmpfs_options("overlay", "size=10%", tmpfs_opts, sizeof(tmpfs_opts));
+        if (mount("", "/mnt", "tmpfs", 0, tmpfs_opts) < 0) {
+            elog(ELOG_ERROR, "Could not mount tmpfs in /mnt: %s\n"
+                 "Check that tmpfs support is enabled in the kernel config.", strerror(errno));
+            return;
+        }
     }
 
     (void) mkdir("/mnt/.merged", 0755);
@@ -102,6 +134,7 @@ void pivot_root_on_overlayfs()
         elog(ELOG_ERROR, "pivot_root failed: %s", strerror(errno));
         return;
     }
+    log_reopen_sinks();
     elog(ELOG_DEBUG, "pivot_root_on_overlayfs done!");
 }
 
@@ -116,6 +149,7 @@ void setup_pseudo_filesystems()
     // /dev should be automatically created/mounted by Linux
     OK_OR_WARN(mount("devtmpfs", "/dev", "devtmpfs", MS_REMOUNT | MS_NOEXEC | MS_NOSUID, "size=1024k"),
                "Cannot remount /dev");
+    log_reopen_sinks();
 
     // Create entries in /dev. Turn off the umask since we want the exact
     // permissions that we're specifying.
@@ -128,25 +162,426 @@ void setup_pseudo_filesystems()
                "Cannot mount /dev/pts");
 }
 
-void mount_filesystems()
+static int has_mount_flag(const char *flags, const char *flag)
 {
-    // Mount /tmp and /run since they're almost always needed and it's
-    // not easy to do it at the right time in Erlang.
-    if (mount("tmpfs", "/tmp", "tmpfs", MS_NOEXEC | MS_NOSUID | MS_NODEV, "mode=1777,size=10%") < 0)
-        elog(ELOG_WARNING, "Could not mount tmpfs in /tmp: %s\r\n"
-             "Check that tmpfs support is enabled in the kernel config.", strerror(errno));
+    size_t len = strlen(flag);
+    const char *p = flags;
+    while ((p = strstr(p, flag)) != NULL) {
+        if ((p == flags || p[-1] == ',') && (p[len] == '\0' || p[len] == ','))
+            return 1;
+        p += len;
+    }
+    return 0;
+}
 
-    if (mount("tmpfs", "/run", "tmpfs", MS_NOEXEC | MS_NOSUID | MS_NODEV, "mode=0755,size=5%") < 0)
-        elog(ELOG_WARNING, "Could not mount tmpfs in /run: %s", strerror(errno));
+// The new mount API (fsopen, fsconfig, fsmount and move_mount) splits
+// creating a filesystem's superblock from attaching it. The constants come
+// from linux/mount.h, which conflicts with sys/mount.h on some C libraries.
+#define MOUNT_API_SET_FLAG 0
+#define MOUNT_API_SET_STRING 1
+#define MOUNT_API_CMD_CREATE 6
+#define MOUNT_API_CLOEXEC 1
+#define MOUNT_API_MOVE_F_EMPTY_PATH 0x00000004
+#define MOUNT_API_ATTR_RDONLY 0x00000001
+#define MOUNT_API_ATTR_NOSUID 0x00000002
+#define MOUNT_API_ATTR_NODEV 0x00000004
+#define MOUNT_API_ATTR_NOEXEC 0x00000008
+#define MOUNT_API_ATTR_NOATIME 0x00000010
+#define MOUNT_API_ATTR_STRICTATIME 0x00000020
+#define MOUNT_API_ATTR_NODIRATIME 0x00000080
 
-    // Mount any filesystems specified by the user. This is best effort.
-    // The user is required to figure out if anything went wrong in their
-    // applications. For example, the filesystem might not be formatted
-    // yet, and erlinit is not smart enough to figure that out.
+struct extra_mount {
+    const char *source;
+    const char *target;
+    const char *fstype;
+    unsigned long flags;
+    const char *data;
+    int independent; // Doesn't need an earlier mount to be attached first
+    int wait_ms;     // How long to wait for a /dev source to appear
+    int prepared;
+    int fd;          // Detached mount or -1
+    int error;       // errno if the new mount API failed
+};
+
+static int mount_api_missing = 0;
+
+#if defined(SYS_fsopen) && defined(SYS_fsconfig) && defined(SYS_fsmount) && defined(SYS_move_mount)
+static int fsconfig_set(int fsfd, unsigned int cmd, const char *key, const char *value)
+{
+    return (int) syscall(SYS_fsconfig, fsfd, cmd, key, value, 0);
+}
+
+static int set_superblock_options(int fsfd, const struct extra_mount *m)
+{
+    if (fsconfig_set(fsfd, MOUNT_API_SET_STRING, "source", m->source) < 0)
+        return -1;
+
+    // MS_SILENT only quiets kernel logs and doesn't have an equivalent
+    if ((m->flags & MS_RDONLY) && fsconfig_set(fsfd, MOUNT_API_SET_FLAG, "ro", NULL) < 0)
+        return -1;
+    if ((m->flags & MS_SYNCHRONOUS) && fsconfig_set(fsfd, MOUNT_API_SET_FLAG, "sync", NULL) < 0)
+        return -1;
+    if ((m->flags & MS_DIRSYNC) && fsconfig_set(fsfd, MOUNT_API_SET_FLAG, "dirsync", NULL) < 0)
+        return -1;
+    if ((m->flags & MS_MANDLOCK) && fsconfig_set(fsfd, MOUNT_API_SET_FLAG, "mand", NULL) < 0)
+        return -1;
+
+    // The data is a comma-separated list of "key" or "key=value" options
+    char *data = strdup(m->data);
+    char *saveptr;
+    int rc = 0;
+    for (char *option = strtok_r(data, ",", &saveptr);
+         option && rc == 0;
+         option = strtok_r(NULL, ",", &saveptr)) {
+        char *value = strchr(option, '=');
+        if (value) {
+            *value++ = '\0';
+            rc = fsconfig_set(fsfd, MOUNT_API_SET_STRING, option, value);
+        } else {
+            rc = fsconfig_set(fsfd, MOUNT_API_SET_FLAG, option, NULL);
+        }
+    }
+    free(data);
+    return rc;
+}
+
+static unsigned int mount_attributes(unsigned long flags)
+{
+    unsigned int attrs = 0;
+    if (flags & MS_RDONLY)
+        attrs |= MOUNT_API_ATTR_RDONLY;
+    if (flags & MS_NOSUID)
+        attrs |= MOUNT_API_ATTR_NOSUID;
+    if (flags & MS_NODEV)
+        attrs |= MOUNT_API_ATTR_NODEV;
+    if (flags & MS_NOEXEC)
+        attrs |= MOUNT_API_ATTR_NOEXEC;
+    if (flags & MS_NODIRATIME)
+        attrs |= MOUNT_API_ATTR_NODIRATIME;
+
+    // relatime is the default
+    if (flags & MS_NOATIME)
+        attrs |= MOUNT_API_ATTR_NOATIME;
+    else if (flags & MS_STRICTATIME)
+        attrs |= MOUNT_API_ATTR_STRICTATIME;
+    return attrs;
+}
+
+// Create the filesystem and return a detached mount for it. This is the
+// slow part since it's where journals get replayed.
+static int create_detached_mount(const struct extra_mount *m)
+{
+    int fsfd = (int) syscall(SYS_fsopen, m->fstype, MOUNT_API_CLOEXEC);
+    if (fsfd < 0)
+        return -1;
+
+    int mfd = -1;
+    if (set_superblock_options(fsfd, m) == 0 &&
+            fsconfig_set(fsfd, MOUNT_API_CMD_CREATE, NULL, NULL) == 0)
+        mfd = (int) syscall(SYS_fsmount, fsfd, MOUNT_API_CLOEXEC, mount_attributes(m->flags));
+
+    int err = errno;
+    close(fsfd);
+    errno = err;
+    return mfd;
+}
+
+static int attach_detached_mount(int fd, const char *target)
+{
+    return (int) syscall(SYS_move_mount, fd, "", AT_FDCWD, target, MOUNT_API_MOVE_F_EMPTY_PATH);
+}
+#else
+static int create_detached_mount(const struct extra_mount *m)
+{
+    (void) m;
+    errno = ENOSYS;
+    return -1;
+}
+
+static int attach_detached_mount(int fd, const char *target)
+{
+    (void) fd;
+    (void) target;
+    errno = ENOSYS;
+    return -1;
+}
+#endif
+
+#ifndef __APPLE__
+static int open_uevent_socket()
+{
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0)
+        return -1;
+
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1; // Kernel uevents
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+#define DEVICE_POLL_MS 50
+
+static void wait_for_device(const char *path, int timeout_ms)
+{
+    // devtmpfs creates device nodes before the kernel sends the uevent,
+    // so check for the path again after each uevent. The socket is opened
+    // before the first check so that no uevents are missed. Symlinks like
+    // /dev/disk/by-label are made by mdev or udev after the kernel's
+    // uevent, so the path is also checked every DEVICE_POLL_MS.
+    struct stat st;
+    if (stat(path, &st) == 0)
+        return;
+
+    int fd = open_uevent_socket();
+    if (fd < 0) {
+        elog(ELOG_WARNING, "Cannot listen for uevents: %s", strerror(errno));
+        return;
+    }
+
+    elog(ELOG_DEBUG, "Waiting up to %d ms for %s", timeout_ms, path);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long deadline_ms = now.tv_sec * 1000LL + now.tv_nsec / 1000000 + timeout_ms;
+
+    // Time spent in poll timeouts is counted too in case the clock is off
+    long long polled_ms = 0;
+    while (stat(path, &st) < 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long ms_left = deadline_ms - (now.tv_sec * 1000LL + now.tv_nsec / 1000000);
+        if (ms_left > timeout_ms - polled_ms)
+            ms_left = timeout_ms - polled_ms;
+        if (ms_left <= 0) {
+            elog(ELOG_WARNING, "Timed out waiting for %s", path);
+            break;
+        }
+
+        int poll_ms = ms_left < DEVICE_POLL_MS ? (int) ms_left : DEVICE_POLL_MS;
+        struct pollfd fds = {fd, POLLIN, 0};
+        int ready = poll(&fds, 1, poll_ms);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready == 0) {
+            polled_ms += poll_ms;
+            continue;
+        }
+
+        char msg[2048];
+        if (ready < 0 || (recv(fd, msg, sizeof(msg), 0) < 0 && errno != EINTR && errno != ENOBUFS)) {
+            elog(ELOG_WARNING, "Can't wait for %s: %s", path, strerror(errno));
+            break;
+        }
+    }
+    close(fd);
+}
+#else
+static void wait_for_device(const char *path, int timeout_ms)
+{
+    (void) path;
+    (void) timeout_ms;
+}
+#endif
+
+static void prepare_mount(struct extra_mount *m)
+{
+    // Storage on USB and SDIO can show up after erlinit starts
+    if (m->wait_ms > 0 && strncmp(m->source, "/dev/", 5) == 0)
+        wait_for_device(m->source, m->wait_ms);
+
+    m->prepared = 1;
+    m->fd = mount_api_missing ? -1 : create_detached_mount(m);
+    m->error = m->fd < 0 ? errno : 0;
+    if (m->error == ENOSYS)
+        mount_api_missing = 1;
+}
+
+static int send_mount_fd(int sock, int index, int fd, int error)
+{
+    int msg[2] = {index, error};
+    struct iovec iov = {msg, sizeof(msg)};
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    if (fd >= 0) {
+        memset(control, 0, sizeof(control));
+        hdr.msg_control = control;
+        hdr.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    return sendmsg(sock, &hdr, 0) < 0 ? -1 : 0;
+}
+
+static int receive_mount_fd(int sock, struct extra_mount *mounts, int count)
+{
+    int msg[2];
+    struct iovec iov = {msg, sizeof(msg)};
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+
+    ssize_t amt;
+    do {
+        amt = recvmsg(sock, &hdr, MSG_CMSG_CLOEXEC);
+    } while (amt < 0 && errno == EINTR);
+    if (amt != sizeof(msg) || msg[0] < 0 || msg[0] >= count)
+        return -1;
+
+    struct extra_mount *m = &mounts[msg[0]];
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    m->prepared = 1;
+    m->error = msg[1];
+    m->fd = -1;
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(&m->fd, CMSG_DATA(cmsg), sizeof(int));
+    if (m->error == ENOSYS)
+        mount_api_missing = 1;
+    return 0;
+}
+
+static void prepare_mounts_in_parallel(struct extra_mount *mounts, int count)
+{
+    // Each worker creates one filesystem and passes the detached mount back
+    // over a socket. The received fd holds a reference to the detached
+    // mount, so it's still good after the worker exits.
     //
+    // If anything here fails, the mounts are prepared when they're attached.
+    pid_t *workers = malloc(count * sizeof(pid_t));
+    if (!workers)
+        return;
+
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) < 0) {
+        free(workers);
+        return;
+    }
+
+    int num_workers = 0;
+    for (int i = 0; i < count; i++) {
+        if (!mounts[i].independent)
+            continue;
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(sockets[0]);
+            prepare_mount(&mounts[i]);
+            send_mount_fd(sockets[1], i, mounts[i].fd, mounts[i].error);
+            exit(EXIT_SUCCESS);
+        } else if (pid > 0) {
+            workers[num_workers++] = pid;
+        }
+    }
+    close(sockets[1]);
+
+    // Anything that isn't reported back is prepared when it's attached
+    for (int i = 0; i < num_workers; i++) {
+        if (receive_mount_fd(sockets[0], mounts, count) < 0)
+            break;
+    }
+    close(sockets[0]);
+
+    for (int i = 0; i < num_workers; i++) {
+        while (waitpid(workers[i], NULL, 0) < 0 && errno == EINTR)
+            ;
+    }
+    free(workers);
+}
+
+static int attach_mount(struct extra_mount *m)
+{
+    if (!m->prepared)
+        prepare_mount(m);
+
+    // Try to mkdir the target just in case the final path entry does
+    // not exist. This is a convenience for mounting in filesystems
+    // created by the kernel like /dev and /sys/fs/*.
+    (void) mkdir(m->target, 0755);
+
+    if (m->fd >= 0) {
+        int rc = attach_detached_mount(m->fd, m->target);
+        int err = errno;
+        close(m->fd);
+        m->fd = -1;
+        if (rc == 0)
+            return 0;
+        m->error = err;
+    }
+
+    // Fall back to mount(2) for old kernels and anything that the new mount
+    // API didn't like. This also reports the error if it really failed.
+    if (m->error != ENOSYS)
+        elog(ELOG_DEBUG, "New mount API failed for %s (%s). Trying mount().", m->target, strerror(m->error));
+    if (mount(m->source, m->target, m->fstype, m->flags, (void *) m->data) < 0) {
+        m->error = errno;
+        elog(ELOG_WARNING, "Cannot mount %s at %s: %s", m->source, m->target, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int is_independent_mount(const struct extra_mount *m)
+{
+    // Block devices and sources like "tmpfs" don't depend on earlier
+    // mounts. Other paths (loop files, bind mounts, overlayfs lowerdirs)
+    // might be on one.
+    return (strncmp(m->source, "/dev/", 5) == 0 || strchr(m->source, '/') == NULL) &&
+           strchr(m->data, '/') == NULL;
+}
+
+enum mount_group {
+    MOUNT_GROUP_BOOT,
+    MOUNT_GROUP_DEFERRED, // "defer" with --defer-noncritical
+    MOUNT_GROUP_ASYNC     // "async"
+};
+
+static int mount_wait_of(const char *flags)
+{
+    // "wait=<ms>" overrides --mount-wait for one entry
+    const char *p = flags;
+    while ((p = strstr(p, "wait=")) != NULL) {
+        if (p == flags || p[-1] == ',')
+            return strtol(p + 5, NULL, 0);
+        p += 5;
+    }
+    return options.mount_wait_ms;
+}
+
+static enum mount_group mount_group_of(const char *flags)
+{
+    if (has_mount_flag(flags, "async"))
+        return MOUNT_GROUP_ASYNC;
+    else if (options.defer_noncritical && has_mount_flag(flags, "defer"))
+        return MOUNT_GROUP_DEFERRED;
+    else
+        return MOUNT_GROUP_BOOT;
+}
+
+// Parse the -m entries in a group. The entries point into *mounts_str,
+// which the caller frees along with the returned array.
+static int parse_extra_mounts(enum mount_group group, char **mounts_str, struct extra_mount **result)
+{
     // An example mount specification looks like:
     //    /dev/mmcblk0p4:/mnt:vfat::utf8
-    char *temp = options.extra_mounts;
+    *mounts_str = options.extra_mounts ? strdup(options.extra_mounts) : NULL;
+    *result = NULL;
+
+    char *temp = *mounts_str;
+    struct extra_mount *mounts = NULL;
+    int count = 0;
 
     while (temp) {
         const char *source = strsep(&temp, ":");
@@ -156,24 +591,379 @@ void mount_filesystems()
         const char *data = strsep(&temp, ";"); // multi-mount separator
 
         if (source && target && filesystemtype && mountflags && data) {
-            // Try to mkdir the target just in case the final path entry does
-            // not exist. This is a convenience for mounting in filesystems
-            // created by the kernel like /dev and /sys/fs/*.
-            (void) mkdir(target, 0755);
-
-            unsigned long imountflags = str_to_mountflags(mountflags);
-            if (mount(source, target, filesystemtype, imountflags, (void *) data) < 0)
-                elog(ELOG_WARNING, "Cannot mount %s at %s: %s", source, target, strerror(errno));
-        } else {
+            if (mount_group_of(mountflags) != group)
+                continue;
+
+            struct extra_mount *new_mounts = realloc(mounts, (count + 1) * sizeof(struct extra_mount));
+            if (!new_mounts)
+                break;
+            mounts = new_mounts;
+
+            struct extra_mount *m = &mounts[count++];
+            memset(m, 0, sizeof(*m));
+            m->source = source;
+            m->target = target;
+            m->fstype = filesystemtype;
+            m->wait_ms = mount_wait_of(mountflags);
+            m->flags = str_to_mountflags(mountflags);
+            m->data = data;
+            m->fd = -1;
+            m->independent = is_independent_mount(m);
+        } else if (group == MOUNT_GROUP_BOOT) {
             elog(ELOG_WARNING, "Invalid parameter to -m. Expecting 5 colon-separated fields");
         }
     }
+
+    *result = mounts;
+    return count;
 }
 
-void unmount_all()
+static void publish_mount_status(const struct extra_mount *m, int rc)
 {
-    elog(ELOG_DEBUG, "unmount_all");
+    // Create /run/erlinit/mounts/<target>.ready or .failed so that
+    // applications can wait for just the mounts they need
+    char path[ERLINIT_PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/mounts%s.%s", ERLINIT_RUN_DIR, m->target,
+                 rc == 0 ? "ready" : "failed") >= (int) sizeof(path))
+        return;
+
+    for (char *slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        (void) mkdir(path, 0755);
+        *slash = '/';
+    }
+
+    // Write to a temporary file first so that the file never shows up
+    // without the error message
+    char tmp_path[ERLINIT_PATH_MAX + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp_path, "w");
+    if (!fp) {
+        elog(ELOG_WARNING, "Cannot write %s: %s", path, strerror(errno));
+        return;
+    }
+    if (rc != 0)
+        fprintf(fp, "%s\n", strerror(m->error));
+    fclose(fp);
 
+    if (rename(tmp_path, path) < 0) {
+        elog(ELOG_WARNING, "Cannot write %s: %s", path, strerror(errno));
+        (void) unlink(tmp_path);
+    }
+}
+
+static void mount_extra_filesystems(enum mount_group group)
+{
+    // Mount any filesystems specified by the user. This is best effort.
+    // The user is required to figure out if anything went wrong in their
+    // applications. For example, the filesystem might not be formatted
+    // yet, and erlinit is not smart enough to figure that out.
+    //
+    // Mounts with the "defer" flag are skipped here and mounted later by
+    // mount_deferred_filesystems() when --defer-noncritical is set. Mounts
+    // with the "async" flag are mounted by mount_async_filesystems() while
+    // Erlang starts.
+    //
+    // Filesystems on block devices are created concurrently since
+    // replaying a journal can take a while. They're attached in order so
+    // that mounts inside other mounts work.
+    char *mounts_str;
+    struct extra_mount *mounts;
+    int count = parse_extra_mounts(group, &mounts_str, &mounts);
+
+    int num_independent = 0;
+    for (int i = 0; i < count; i++)
+        num_independent += mounts[i].independent;
+
+    if (num_independent > 1 && !mount_api_missing)
+        prepare_mounts_in_parallel(mounts, count);
+
+    for (int i = 0; i < count; i++) {
+        int rc = attach_mount(&mounts[i]);
+        if (group == MOUNT_GROUP_ASYNC)
+            publish_mount_status(&mounts[i], rc);
+    }
+
+    free(mounts);
+    free(mounts_str);
+}
+
+void mount_filesystems()
+{
+    // Compressed swap goes first so that it's there for everything after
+    if (options.zram)
+        setup_zram_swap();
+
+    // Mount /tmp and /run since they're almost always needed and it's
+    // not easy to do it at the right time in Erlang. See tmpfs_options()
+    // for how their sizes can be changed.
+    char tmpfs_opts[256];
+    tmpfs_options("/tmp", "mode=1777,size=10%", tmpfs_opts, sizeof(tmpfs_opts));
+    if (mount_zram("/tmp", "/tmp", MS_NOEXEC | MS_NOSUID | MS_NODEV) == 0)
+        OK_OR_WARN(chmod("/tmp", 01777), "Cannot set permissions on /tmp");
+    else if (mount("tmpfs", "/tmp", "tmpfs", MS_NOEXEC | MS_NOSUID | MS_NODEV, tmpfs_opts) < 0)
+        elog(ELOG_WARNING, "Could not mount tmpfs in /tmp: %s\r\n"
+             "Check that tmpfs support is enabled in the kernel config.", strerror(errno));
+
+    tmpfs_options("/run", "mode=0755,size=5%", tmpfs_opts, sizeof(tmpfs_opts));
+    if (mount("tmpfs", "/run", "tmpfs", MS_NOEXEC | MS_NOSUID | MS_NODEV, tmpfs_opts) < 0)
+        elog(ELOG_WARNING, "Could not mount tmpfs in /run: %s", strerror(errno));
+
+    mount_extra_filesystems(MOUNT_GROUP_BOOT);
+}
+
+void mount_deferred_filesystems()
+{
+    mount_extra_filesystems(MOUNT_GROUP_DEFERRED);
+}
+
+int has_async_mounts()
+{
+    // Only look at the flags field so that warnings aren't printed twice
+    if (!options.extra_mounts)
+        return 0;
+
+    char *mounts_str = strdup(options.extra_mounts);
+    char *temp = mounts_str;
+    int found = 0;
+    while (temp && !found) {
+        strsep(&temp, ":");
+        strsep(&temp, ":");
+        strsep(&temp, ":");
+        const char *mountflags = strsep(&temp, ":");
+        strsep(&temp, ";");
+        found = mountflags && mount_group_of(mountflags) == MOUNT_GROUP_ASYNC;
+    }
+    free(mounts_str);
+    return found;
+}
+
+void mount_async_filesystems()
+{
+    mount_extra_filesystems(MOUNT_GROUP_ASYNC);
+}
+
+struct mount_entry {
+    int id;
+    int parent_id;
+    int parent; // index into the mount table or -1
+    int top;    // index of the mount under / that this is in or -1
+    int done;
+    int read_only;
+    unsigned long dev;
+    char *target;
+    char *fstype;
+    char *source;
+};
+
+struct mount_table {
+    struct mount_entry *entries;
+    int count;
+    int root;
+};
+
+static void unescape_mount_path(char *path)
+{
+    // mountinfo escapes spaces, tabs, newlines and backslashes as \ooo
+    char *out = path;
+    for (char *in = path; *in; in++) {
+        if (in[0] == '\\' &&
+                in[1] >= '0' && in[1] <= '3' &&
+                in[2] >= '0' && in[2] <= '7' &&
+                in[3] >= '0' && in[3] <= '7') {
+            *out++ = (char) (((in[1] - '0') << 6) | ((in[2] - '0') << 3) | (in[3] - '0'));
+            in += 3;
+        } else {
+            *out++ = *in;
+        }
+    }
+    *out = '\0';
+}
+
+static int parse_mountinfo_line(char *line, struct mount_entry *entry)
+{
+    // Format: id parent major:minor root target options [optional...] - fstype source super_options
+    char *fields[6];
+    char *p = line;
+    for (int i = 0; i < 6; i++) {
+        fields[i] = strsep(&p, " ");
+        if (!fields[i] || !p)
+            return -1;
+    }
+
+    char *separator = strstr(p, "- ");
+    if (!separator)
+        return -1;
+    p = separator + 2;
+
+    char *fstype = strsep(&p, " ");
+    char *source = strsep(&p, " ");
+    if (!fstype || !source)
+        return -1;
+
+    unescape_mount_path(fields[4]);
+    unescape_mount_path(source);
+
+    unsigned int major = 0;
+    unsigned int minor = 0;
+    if (sscanf(fields[2], "%u:%u", &major, &minor) != 2)
+        return -1;
+
+    entry->id = strtol(fields[0], NULL, 10);
+    entry->parent_id = strtol(fields[1], NULL, 10);
+    entry->parent = -1;
+    entry->top = -1;
+    entry->done = 0;
+    entry->dev = ((unsigned long) major << 20) | minor;
+    entry->read_only = strncmp(fields[5], "ro", 2) == 0 && (fields[5][2] == ',' || fields[5][2] == '\0');
+    entry->target = strdup(fields[4]);
+    entry->fstype = strdup(fstype);
+    entry->source = strdup(source);
+    return 0;
+}
+
+static void free_mount_table(struct mount_table *table)
+{
+    for (int i = 0; i < table->count; i++) {
+        free(table->entries[i].target);
+        free(table->entries[i].fstype);
+        free(table->entries[i].source);
+    }
+    free(table->entries);
+}
+
+static int read_mount_table(struct mount_table *table)
+{
+    FILE *fp = fopen("/proc/self/mountinfo", "r");
+    if (!fp)
+        return -1;
+
+    int capacity = 0;
+    table->entries = NULL;
+    table->count = 0;
+    table->root = -1;
+
+    char *line = NULL;
+    size_t line_len = 0;
+    while (getline(&line, &line_len, fp) > 0) {
+        line[strcspn(line, "\n")] = '\0';
+
+        if (table->count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            struct mount_entry *entries = realloc(table->entries, capacity * sizeof(struct mount_entry));
+            if (!entries) {
+                free(line);
+                fclose(fp);
+                free_mount_table(table);
+                return -1;
+            }
+            table->entries = entries;
+        }
+
+        if (parse_mountinfo_line(line, &table->entries[table->count]) == 0)
+            table->count++;
+    }
+    free(line);
+    fclose(fp);
+
+    // Link up the tree. The root is the last mount on / since it hides
+    // anything underneath it.
+    for (int i = 0; i < table->count; i++) {
+        struct mount_entry *entry = &table->entries[i];
+        if (strcmp(entry->target, "/") == 0)
+            table->root = i;
+
+        for (int j = 0; j < table->count; j++) {
+            if (j != i && table->entries[j].id == entry->parent_id) {
+                entry->parent = j;
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < table->count; i++) {
+        int top = i;
+        int depth = 0;
+        while (top >= 0 && table->entries[top].parent != table->root && depth++ < table->count)
+            top = table->entries[top].parent;
+        table->entries[i].top = top;
+    }
+    return 0;
+}
+
+static int skip_unmount(const struct mount_entry *entry)
+{
+    // Allow directories that don't unmount or remount immediately (rootfs)
+    return strcmp(entry->source, "devtmpfs") == 0 ||
+           strcmp(entry->source, "/dev/root") == 0 ||
+           strcmp(entry->fstype, "rootfs") == 0;
+}
+
+static void unmount_entry(struct mount_table *table, int index)
+{
+    struct mount_entry *entry = &table->entries[index];
+    if (entry->done)
+        return;
+    entry->done = 1;
+
+    // Children have to be unmounted first. They're usually later in the
+    // table.
+    for (int i = table->count - 1; i >= 0; i--) {
+        if (table->entries[i].parent == index)
+            unmount_entry(table, i);
+    }
+
+    if (index == table->root || skip_unmount(entry))
+        return;
+
+    elog(ELOG_DEBUG, "unmounting %s at %s...", entry->source, entry->target);
+    if (umount(entry->target) < 0) {
+        elog(ELOG_WARNING, "umount %s failed: %s. Detaching it instead.", entry->target, strerror(errno));
+        OK_OR_WARN(umount2(entry->target, MNT_DETACH), "umount2 %s failed: %s", entry->target, strerror(errno));
+    }
+}
+
+static int is_block_backed(const struct mount_entry *entry)
+{
+    return strncmp(entry->source, "/dev/", 5) == 0;
+}
+
+static void unmount_top_in_worker(struct mount_table *table, int top, pid_t *workers, int *num_workers)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        unmount_entry(table, top);
+        exit(EXIT_SUCCESS);
+    } else if (pid < 0) {
+        unmount_entry(table, top);
+        return;
+    }
+
+    workers[(*num_workers)++] = pid;
+
+    // Mark the subtree as handled in this process
+    for (int i = 0; i < table->count; i++) {
+        if (table->entries[i].top == top)
+            table->entries[i].done = 1;
+    }
+}
+
+static void remount_root_read_only(const struct mount_table *table)
+{
+    if (table->root < 0 || table->entries[table->root].read_only)
+        return;
+
+    elog(ELOG_DEBUG, "remounting / read-only...");
+    OK_OR_WARN(mount(NULL, "/", NULL, MS_REMOUNT | MS_RDONLY, NULL),
+               "Cannot remount / read-only: %s", strerror(errno));
+}
+
+#define MAX_SERIAL_UNMOUNTS 32
+
+static void unmount_all_serially()
+{
+    // This doesn't allocate memory in case that's why the mount table
+    // couldn't be read
     FILE *fp = fopen("/proc/mounts", "r");
     if (!fp) {
         elog(ELOG_WARNING, "/proc/mounts not found");
@@ -183,25 +973,197 @@ void unmount_all()
     struct mount_info {
         char source[256];
         char target[256];
-    } mounts[MAX_MOUNTS];
+    } mounts[MAX_SERIAL_UNMOUNTS];
 
     int i = 0;
-    while (i < MAX_MOUNTS &&
+    while (i < MAX_SERIAL_UNMOUNTS &&
             fscanf(fp, "%255s %255s %*s %*s %*d %*d", mounts[i].source, mounts[i].target) == 2) {
         i++;
     }
     fclose(fp);
 
-    // Unmount as much as we can in reverse order.
-    int num_mounts = i;
-    for (i = num_mounts - 1; i >= 0; i--) {
-        // Allow directories that don't unmount or remount immediately (rootfs)
+    // Unmount as much as possible in reverse order
+    for (i = i - 1; i >= 0; i--) {
         if (strcmp(mounts[i].source, "devtmpfs") == 0 ||
-                strcmp(mounts[i].source, "/dev/root") == 0)
+                strcmp(mounts[i].source, "/dev/root") == 0 ||
+                strcmp(mounts[i].target, "/") == 0)
             continue;
 
         elog(ELOG_DEBUG, "unmounting %s at %s...", mounts[i].source, mounts[i].target);
-        if (umount(mounts[i].target) < 0 && umount(mounts[i].source) < 0)
-            elog(ELOG_WARNING, "umount %s failed: %s", mounts[i].target, strerror(errno));
+        if (umount(mounts[i].target) < 0) {
+            elog(ELOG_WARNING, "umount %s failed: %s. Detaching it instead.", mounts[i].target, strerror(errno));
+            OK_OR_WARN(umount2(mounts[i].target, MNT_DETACH), "umount2 %s failed: %s", mounts[i].target, strerror(errno));
+        }
+    }
+}
+
+void unmount_all()
+{
+    elog(ELOG_DEBUG, "unmount_all");
+
+    struct mount_table table;
+    if (read_mount_table(&table) < 0) {
+        elog(ELOG_WARNING, "Can't read /proc/self/mountinfo. Unmounting serially.");
+        unmount_all_serially();
+        return;
+    }
+
+    // Mounts under / that are independent of each other can be unmounted
+    // at the same time. Only do this for subtrees with block devices since
+    // they're the ones that take time to flush. Everything else is
+    // unmounted here in reverse order. If there's no memory to track the
+    // workers, everything is unmounted here.
+    pid_t *workers = malloc((table.count + 1) * sizeof(pid_t));
+    int num_workers = 0;
+    for (int i = 0; workers && i < table.count; i++) {
+        struct mount_entry *entry = &table.entries[i];
+        int top = entry->top;
+        if (top >= 0 && !table.entries[top].done && is_block_backed(entry) && !skip_unmount(entry))
+            unmount_top_in_worker(&table, top, workers, &num_workers);
+    }
+
+    for (int i = table.count - 1; i >= 0; i--)
+        unmount_entry(&table, i);
+
+    for (int i = 0; i < num_workers; i++) {
+        while (waitpid(workers[i], NULL, 0) < 0 && errno == EINTR)
+            ;
     }
+    free(workers);
+
+    remount_root_read_only(&table);
+    free_mount_table(&table);
+}
+
+static int is_pseudo_filesystem(const char *fstype)
+{
+    static const char *pseudo_filesystems[] = {
+        "bpf", "binfmt_misc", "cgroup", "cgroup2", "configfs", "debugfs",
+        "devpts", "devtmpfs", "efivarfs", "fusectl", "hugetlbfs", "mqueue",
+        "proc", "pstore", "ramfs", "rootfs", "securityfs", "sysfs", "tmpfs",
+        "tracefs", NULL
+    };
+
+    for (const char **name = pseudo_filesystems; *name; name++) {
+        if (strcmp(fstype, *name) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static long long flush_filesystem(const char *target)
+{
+    int fd = open(target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int rc = syncfs(fd);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    close(fd);
+
+    if (rc < 0)
+        return -1;
+    return (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000;
+}
+
+int sync_filesystems(struct fs_sync_report *reports, int max_reports,
+                     void (*while_flushing)(void *arg), void *arg)
+{
+    // Flush each writable filesystem on its own so that a slow one doesn't
+    // hold up the others and so that it's possible to see which one is slow.
+    // The caller can do other work while the flushes run.
+    struct mount_table table;
+    if (read_mount_table(&table) < 0) {
+        if (while_flushing)
+            while_flushing(arg);
+        sync();
+        return 0;
+    }
+
+    // Bind mounts share a filesystem, so only flush it once
+    int *to_sync = malloc((table.count + 1) * sizeof(int));
+    pid_t *workers = malloc((table.count + 1) * sizeof(pid_t));
+    if (!to_sync || !workers) {
+        elog(ELOG_WARNING, "Can't flush filesystems individually: out of memory");
+        if (while_flushing)
+            while_flushing(arg);
+        sync();
+        free(workers);
+        free(to_sync);
+        free_mount_table(&table);
+        return 0;
+    }
+
+    int count = 0;
+    for (int i = 0; i < table.count; i++) {
+        const struct mount_entry *entry = &table.entries[i];
+        if (entry->read_only || is_pseudo_filesystem(entry->fstype))
+            continue;
+
+        int duplicate = 0;
+        for (int j = 0; j < count && !duplicate; j++)
+            duplicate = table.entries[to_sync[j]].dev == entry->dev;
+        if (!duplicate)
+            to_sync[count++] = i;
+    }
+
+    // Workers report back through shared memory
+    struct fs_sync_report *results = NULL;
+    if (count > 0) {
+        results = mmap(NULL, count * sizeof(struct fs_sync_report),
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (results == MAP_FAILED) {
+            elog(ELOG_WARNING, "Can't flush filesystems individually: %s", strerror(errno));
+            if (while_flushing)
+                while_flushing(arg);
+            while_flushing = NULL;
+            sync();
+            count = 0;
+            results = NULL;
+        }
+    }
+
+    int num_workers = 0;
+    for (int i = 0; i < count; i++) {
+        const char *target = table.entries[to_sync[i]].target;
+        snprintf(results[i].target, sizeof(results[i].target), "%s", target);
+
+        pid_t pid = count > 1 ? fork() : -1;
+        if (pid == 0) {
+            results[i].duration_us = flush_filesystem(target);
+            exit(EXIT_SUCCESS);
+        } else if (pid < 0) {
+            results[i].duration_us = flush_filesystem(target);
+        } else {
+            workers[num_workers++] = pid;
+        }
+    }
+    if (while_flushing)
+        while_flushing(arg);
+
+    for (int i = 0; i < num_workers; i++) {
+        while (waitpid(workers[i], NULL, 0) < 0 && errno == EINTR)
+            ;
+    }
+    free(workers);
+
+    int reported = 0;
+    for (int i = 0; i < count; i++) {
+        if (results[i].duration_us < 0)
+            elog(ELOG_WARNING, "syncfs %s failed", results[i].target);
+        else
+            elog(ELOG_DEBUG, "syncfs %s took %lld us", results[i].target, results[i].duration_us);
+
+        if (reported < max_reports)
+            reports[reported++] = results[i];
+    }
+
+    if (results)
+        munmap(results, count * sizeof(struct fs_sync_report));
+    free(to_sync);
+    free_mount_table(&table);
+    return reported;
 }
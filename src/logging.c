@@ -8,26 +8,103 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#include <sys/mman.h>
 #include <sys/reboot.h>
+#include <sys/uio.h>
 
-static int kmsg_format(int severity, char **strp, const char *msg)
+#define FATAL_MESSAGE "FATAL ERROR. CANNOT CONTINUE."
+#define REBOOTING_MESSAGE "Rebooting due to fatal error..."
+#define REBOOT_FAILED_MESSAGE "Rebooting failed. Going to try to trigger a kernel panic reboot."
+
+// Log sinks are opened on first use and kept open. SINK_CLOSED means that
+// the next message should try to open it.
+#define SINK_CLOSED -2
+#define SINK_UNAVAILABLE -1
+
+static int kmsg_fd = SINK_CLOSED;
+static int pmsg_fd = SINK_CLOSED;
+
+// Most messages fit in this. Longer ones are allocated.
+#define LOG_BUFFER_SIZE 1024
+
+// Every logged message is also saved to a ring buffer so that messages
+// logged before /dev/kmsg and /dev/pmsg0 are available can be sent there
+// later and so that they can be included in the shutdown report. The ring
+// buffer is shared memory so that messages from the child process and
+// helpers are included too.
+#define LOG_RING_RECORDS 256
+#define LOG_RECORD_MSG_SIZE 160
+
+#define LOG_RECORD_WANTS_KMSG 1
+#define LOG_RECORD_WANTS_PMSG 2
+#define LOG_RECORD_WROTE_KMSG 4
+#define LOG_RECORD_WROTE_PMSG 8
+
+struct log_record {
+    unsigned int seq; // index + 1 when the record is complete
+    int severity;
+    int flags;
+    long long usec;
+    char msg[LOG_RECORD_MSG_SIZE];
+};
+
+struct log_ring {
+    unsigned int next;
+    struct log_record records[LOG_RING_RECORDS];
+};
+
+static struct log_ring *log_ring = NULL;
+static struct timespec log_start;
+
+static int open_sink(int *fd, const char *path)
 {
-    int prival = 3 * 8 + (severity & ELOG_SEVERITY_MASK); // facility=daemon(3)
-    return asprintf(strp, "<%d>" PROGRAM_NAME ": %s\n", prival, msg);
+    if (*fd == SINK_CLOSED)
+        *fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (*fd < 0)
+        *fd = SINK_UNAVAILABLE;
+    return *fd;
+}
+
+static void close_sink(int *fd)
+{
+    if (*fd >= 0)
+        close(*fd);
+    *fd = SINK_CLOSED;
+}
+
+static void flush_ring(void);
+
+void log_reopen_sinks()
+{
+    // Call this when /dev changes so that the device files on the new /dev
+    // get used. Opening them now also keeps processes forked later from
+    // opening their own.
+    close_sink(&kmsg_fd);
+    close_sink(&pmsg_fd);
+
+    if (!options.resolve_release) {
+        open_sink(&kmsg_fd, "/dev/kmsg");
+        open_sink(&pmsg_fd, "/dev/pmsg0");
+        flush_ring();
+    }
 }
 
-static int stderr_format(char **strp, const char *msg)
+static void write_iov(int fd, struct iovec *iov, int iovcnt)
 {
-    return asprintf(strp, PROGRAM_NAME ": %s\n", msg);
+    // kmsg creates one record per write, so the whole message
+    // needs to go out at once.
+    ssize_t ignore = writev(fd, iov, iovcnt);
+    (void) ignore;
 }
 
-static int pmsg_format(char **strp, const char *msg)
+static int pmsg_timestamp(char *buffer, size_t len)
 {
     struct timespec ts;
     if (clock_gettime(CLOCK_REALTIME, &ts) != 0)
@@ -41,87 +118,234 @@ static int pmsg_format(char **strp, const char *msg)
 
     // Match the RFC3339 timestamps from Erlang's logger_formatter
     // 2025-12-04T00:01:34.200744+00:00
-    return asprintf(
-            strp,
-            "%04d-%02d-%02dT%02d:%02d:%02d.%06ld+00:00 " PROGRAM_NAME " %s\n",
+    return snprintf(
+            buffer,
+            len,
+            "%04d-%02d-%02dT%02d:%02d:%02d.%06ld+00:00 " PROGRAM_NAME " ",
             tm.tm_year + 1900,
             tm.tm_mon + 1,
             tm.tm_mday,
             tm.tm_hour,
             tm.tm_min,
             tm.tm_sec,
-            usec,
-            msg
-        );
+            usec);
 }
 
-static void log_pmsg_breadcrumb(const char *msg)
+static int log_pmsg_breadcrumb(const char *msg, size_t msg_len)
 {
-    static int open_failed = 0;
+    // Don't bother trying again on failures.
+    if (options.resolve_release || open_sink(&pmsg_fd, "/dev/pmsg0") < 0)
+        return 0;
 
-    int pmsg_fd;
-    if (open_failed) {
-        // Don't bother trying again on failures.
-        return;
+    char timestamp[64];
+    int len = pmsg_timestamp(timestamp, sizeof(timestamp));
+    if (len < 0)
+        return 0;
+
+    struct iovec iov[3] = {
+        {timestamp, len},
+        {(void *) msg, msg_len},
+        {"\n", 1}
+    };
+    write_iov(pmsg_fd, iov, 3);
+    return 1;
+}
+
+static void write_kmsg(int severity, const char *tag, const char *msg, size_t msg_len)
+{
+    char prefix[48];
+    int prival = 3 * 8 + (severity & ELOG_SEVERITY_MASK); // facility=daemon(3)
+    int len = snprintf(prefix, sizeof(prefix), "<%d>" PROGRAM_NAME ": %s", prival, tag);
+
+    struct iovec iov[3] = {
+        {prefix, len},
+        {(void *) msg, msg_len},
+        {"\n", 1}
+    };
+    write_iov(kmsg_fd, iov, 3);
+}
+
+static int log_write(int severity, const char *msg, size_t msg_len)
+{
+    // Only log to the kernel when running as PID 1
+    if (!options.resolve_release && open_sink(&kmsg_fd, "/dev/kmsg") >= 0) {
+        write_kmsg(severity, "", msg, msg_len);
+        return 1;
     } else {
-        pmsg_fd = open("/dev/pmsg0", O_WRONLY | O_CLOEXEC);
-        if (pmsg_fd < 0) {
-            open_failed = 1;
-            return;
-        }
+        struct iovec iov[3] = {
+            {PROGRAM_NAME ": ", sizeof(PROGRAM_NAME ": ") - 1},
+            {(void *) msg, msg_len},
+            {"\n", 1}
+        };
+        write_iov(STDERR_FILENO, iov, 3);
+        return 0;
     }
+}
+
+static struct log_record *ring_add(int severity, int flags, const char *msg, size_t msg_len)
+{
+    if (log_ring == NULL)
+        return NULL;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-    char *str;
-    int len = pmsg_format(&str, msg);
-    if (len > 0) {
-        ssize_t ignore = write(pmsg_fd, str, len);
-        (void) ignore;
-        free(str);
+    // Other processes may be logging at the same time, so claim a slot first
+    unsigned int index = __atomic_fetch_add(&log_ring->next, 1, __ATOMIC_RELAXED);
+    struct log_record *record = &log_ring->records[index % LOG_RING_RECORDS];
+    record->severity = severity;
+    record->flags = flags;
+    record->usec = (now.tv_sec - log_start.tv_sec) * 1000000LL + (now.tv_nsec - log_start.tv_nsec) / 1000;
+    snprintf(record->msg, sizeof(record->msg), "%.*s", (int) msg_len, msg);
+    __atomic_store_n(&record->seq, index + 1, __ATOMIC_RELEASE);
+    return record;
+}
+
+// Call fun on each complete record from oldest to newest
+static void ring_foreach(void (*fun)(struct log_record *record, void *arg), void *arg)
+{
+    if (log_ring == NULL)
+        return;
+
+    unsigned int end = __atomic_load_n(&log_ring->next, __ATOMIC_ACQUIRE);
+    unsigned int start = end > LOG_RING_RECORDS ? end - LOG_RING_RECORDS : 0;
+    for (unsigned int index = start; index < end; index++) {
+        struct log_record *record = &log_ring->records[index % LOG_RING_RECORDS];
+        if (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) == index + 1)
+            fun(record, arg);
     }
-    close(pmsg_fd);
 }
 
-static void log_write(int severity, const char *msg)
+static void format_elapsed(char *buffer, size_t len, long long usec)
 {
-    char *str;
-    ssize_t ignore;
-    int log_fd = open("/dev/kmsg", O_WRONLY | O_CLOEXEC);
-    if (log_fd >= 0) {
-        int len = kmsg_format(severity, &str, msg);
-        if (len > 0) {
-            ignore = write(log_fd, str, len);
-            free(str);
-        }
-        close(log_fd);
-    } else {
-        int len = stderr_format(&str, msg);
-        if (len > 0) {
-            ignore = write(STDERR_FILENO, str, len);
-            free(str);
-        }
+    snprintf(buffer, len, "[%5lld.%06lld] ", usec / 1000000, usec % 1000000);
+}
+
+static void flush_record_to_kmsg(struct log_record *record, void *arg)
+{
+    (void) arg;
+    if ((record->flags & (LOG_RECORD_WANTS_KMSG | LOG_RECORD_WROTE_KMSG)) != LOG_RECORD_WANTS_KMSG)
+        return;
+
+    char tag[32];
+    format_elapsed(tag, sizeof(tag), record->usec);
+    write_kmsg(record->severity, tag, record->msg, strlen(record->msg));
+    record->flags |= LOG_RECORD_WROTE_KMSG;
+}
+
+struct pmsg_batch {
+    char timestamp[64];
+    int timestamp_len;
+    char tags[LOG_RING_RECORDS][32];
+    struct iovec iov[4 * LOG_RING_RECORDS];
+    int count;
+};
+
+static void add_iov(struct pmsg_batch *batch, const void *base, size_t len)
+{
+    batch->iov[batch->count].iov_base = (void *) base;
+    batch->iov[batch->count].iov_len = len;
+    batch->count++;
+}
+
+static void add_record_to_pmsg_batch(struct log_record *record, void *arg)
+{
+    struct pmsg_batch *batch = (struct pmsg_batch *) arg;
+    if ((record->flags & (LOG_RECORD_WANTS_PMSG | LOG_RECORD_WROTE_PMSG)) != LOG_RECORD_WANTS_PMSG)
+        return;
+
+    char *tag = batch->tags[batch->count / 4];
+    format_elapsed(tag, sizeof(batch->tags[0]), record->usec);
+
+    add_iov(batch, batch->timestamp, batch->timestamp_len);
+    add_iov(batch, tag, strlen(tag));
+    add_iov(batch, record->msg, strlen(record->msg));
+    add_iov(batch, "\n", 1);
+    record->flags |= LOG_RECORD_WROTE_PMSG;
+}
+
+static void flush_ring()
+{
+    // Send everything that couldn't be logged before. kmsg needs one write
+    // per message, but pmsg can take them all at once.
+    if (kmsg_fd >= 0)
+        ring_foreach(flush_record_to_kmsg, NULL);
+
+    if (pmsg_fd >= 0) {
+        struct pmsg_batch batch;
+        batch.count = 0;
+        batch.timestamp_len = pmsg_timestamp(batch.timestamp, sizeof(batch.timestamp));
+        if (batch.timestamp_len < 0)
+            return;
+
+        ring_foreach(add_record_to_pmsg_batch, &batch);
+        if (batch.count > 0)
+            write_iov(pmsg_fd, batch.iov, batch.count);
     }
-    (void) ignore;
+}
+
+static void report_record(struct log_record *record, void *arg)
+{
+    FILE *fp = (FILE *) arg;
+    char tag[32];
+    format_elapsed(tag, sizeof(tag), record->usec);
+    fprintf(fp, "%s%s\n", tag, record->msg);
+}
+
+void log_report(FILE *fp)
+{
+    ring_foreach(report_record, fp);
+}
+
+void log_init()
+{
+    clock_gettime(CLOCK_MONOTONIC, &log_start);
+
+    void *ring = mmap(NULL, sizeof(struct log_ring), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ring != MAP_FAILED)
+        log_ring = (struct log_ring *) ring;
+}
+
+static void log_message(int severity, int log_pmsg, int log_sink, const char *fmt, va_list ap)
+{
+    char buffer[LOG_BUFFER_SIZE];
+    char *msg = buffer;
+
+    va_list ap_copy;
+    va_copy(ap_copy, ap);
+    int len = vsnprintf(buffer, sizeof(buffer), fmt, ap);
+    if (len >= (int) sizeof(buffer))
+        len = vasprintf(&msg, fmt, ap_copy);
+    va_end(ap_copy);
+
+    if (len <= 0)
+        return;
+
+    int flags = (log_pmsg ? LOG_RECORD_WANTS_PMSG : 0) | (log_sink ? LOG_RECORD_WANTS_KMSG : 0);
+    if (log_pmsg && log_pmsg_breadcrumb(msg, len))
+        flags |= LOG_RECORD_WROTE_PMSG;
+
+    if (log_sink && log_write(severity, msg, len))
+        flags |= LOG_RECORD_WROTE_KMSG;
+
+    ring_add(severity, flags, msg, len);
+
+    if (msg != buffer)
+        free(msg);
 }
 
 void elog(int severity, const char *fmt, ...)
 {
+    // Info and more important messages go to the ring even when they're not
+    // printed so that the shutdown report has them. Debug messages are only
+    // formatted when they'd be printed since they're on hot paths and would
+    // push the important ones out of the ring.
     int level = severity & ELOG_SEVERITY_MASK;
     int log_pmsg = severity & ELOG_PMSG;
-    if (level <= options.verbose || log_pmsg) {
+    if (level <= options.verbose || level <= ELOG_LEVEL_INFO || log_pmsg) {
         va_list ap;
         va_start(ap, fmt);
-
-        char *msg;
-        if (vasprintf(&msg, fmt, ap) > 0) {
-            if (log_pmsg)
-                log_pmsg_breadcrumb(msg);
-
-            if (level <= options.verbose)
-                log_write(severity, msg);
-
-            free(msg);
-        }
-
+        log_message(severity, log_pmsg, level <= options.verbose, fmt, ap);
         va_end(ap);
     }
 }
@@ -130,25 +354,22 @@ void fatal(const char *fmt, ...)
 {
     va_list ap;
     va_start(ap, fmt);
-
-    char *msg;
-    if (vasprintf(&msg, fmt, ap) > 0) {
-        log_pmsg_breadcrumb(msg);
-        log_write(ELOG_EMERG, msg);
-        free(msg);
-    }
-
+    log_message(ELOG_EMERG, 1, 1, fmt, ap);
     va_end(ap);
 
-    log_write(ELOG_EMERG, "FATAL ERROR. CANNOT CONTINUE.");
+    log_write(ELOG_EMERG, FATAL_MESSAGE, sizeof(FATAL_MESSAGE) - 1);
+
+    // Definitely don't reboot when not PID 1
+    if (options.resolve_release)
+        exit(EXIT_FAILURE);
 
     // Sleep so that the message can be printed
     sleep(1);
 
     // Halt/reboot/poweroff
-    log_pmsg_breadcrumb("Rebooting due to fatal error...");
+    log_pmsg_breadcrumb(REBOOTING_MESSAGE, sizeof(REBOOTING_MESSAGE) - 1);
     reboot(options.fatal_reboot_cmd);
-    log_pmsg_breadcrumb("Rebooting failed. Going to try to trigger a kernel panic reboot.");
+    log_pmsg_breadcrumb(REBOOT_FAILED_MESSAGE, sizeof(REBOOT_FAILED_MESSAGE) - 1);
 
     // Kernel panic if reboot() returns.
     exit(1);
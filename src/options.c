@@ -37,11 +37,32 @@ struct erlinit_options options = {
     .gid = 0,
     .uid = 0,
     .graceful_shutdown_timeout_ms = 10000,
+    .sigterm_timeout_ms = 1000,
     .update_clock = 0,
     .shutdown_report = NULL,
     .limits = NULL,
     .x_pivot_root_on_overlayfs = 0,
-    .core_pattern = NULL
+    .core_pattern = NULL,
+    .trace_file = NULL,
+    .parallel_boot = 0,
+    .defer_noncritical = 0,
+    .defer_rootdisk_symlinks = 0,
+    .release_cache = NULL,
+    .release_manifest = NULL,
+    .resolve_release = NULL,
+    .prewarm_code = 0,
+    .readahead_list = NULL,
+    .readahead_record_secs = 0,
+    .vm_restart_limit = 0,
+    .vm_restart_window_minutes = 0,
+    .crash_loop_limit = 0,
+    .crash_loop_seconds = 0,
+    .crash_loop_file = NULL,
+    .crash_loop_release_path = NULL,
+    .cmd_timeout_ms = 0,
+    .mount_wait_ms = 0,
+    .tmpfs = NULL,
+    .zram = NULL
 };
 
 enum erlinit_option_value {
@@ -79,6 +100,24 @@ enum erlinit_option_value {
     OPT_TTY_OPTIONS,
     OPT_SHUTDOWN_REPORT,
     OPT_CORE_PATTERN,
+    OPT_TRACE_FILE,
+    OPT_PARALLEL_BOOT,
+    OPT_DEFER_NONCRITICAL,
+    OPT_DEFER_ROOTDISK_SYMLINKS,
+    OPT_RELEASE_CACHE,
+    OPT_RELEASE_MANIFEST,
+    OPT_PREWARM_CODE,
+    OPT_READAHEAD_LIST,
+    OPT_READAHEAD_RECORD,
+    OPT_SIGTERM_TIMEOUT,
+    OPT_RESTART_VM,
+    OPT_CRASH_LOOP,
+    OPT_CRASH_LOOP_FILE,
+    OPT_CRASH_LOOP_RELEASE_PATH,
+    OPT_CMD_TIMEOUT,
+    OPT_MOUNT_WAIT,
+    OPT_TMPFS,
+    OPT_ZRAM,
 
     // Experimental
     OPT_X_PIVOT_ROOT_ON_OVERLAYFS
@@ -115,6 +154,24 @@ static struct option long_options[] = {
     {"limits", required_argument, 0, OPT_LIMIT},
     {"x-pivot-root-on-overlayfs", no_argument, 0, OPT_X_PIVOT_ROOT_ON_OVERLAYFS},
     {"core-pattern", required_argument, 0, OPT_CORE_PATTERN},
+    {"trace-file", required_argument, 0, OPT_TRACE_FILE},
+    {"parallel-boot", no_argument, 0, OPT_PARALLEL_BOOT},
+    {"defer-noncritical", no_argument, 0, OPT_DEFER_NONCRITICAL},
+    {"defer-rootdisk-symlinks", no_argument, 0, OPT_DEFER_ROOTDISK_SYMLINKS},
+    {"release-cache", required_argument, 0, OPT_RELEASE_CACHE},
+    {"release-manifest", required_argument, 0, OPT_RELEASE_MANIFEST},
+    {"prewarm-code", no_argument, 0, OPT_PREWARM_CODE},
+    {"readahead-list", required_argument, 0, OPT_READAHEAD_LIST},
+    {"readahead-record", required_argument, 0, OPT_READAHEAD_RECORD},
+    {"sigterm-timeout", required_argument, 0, OPT_SIGTERM_TIMEOUT},
+    {"restart-vm", required_argument, 0, OPT_RESTART_VM},
+    {"crash-loop", required_argument, 0, OPT_CRASH_LOOP},
+    {"crash-loop-file", required_argument, 0, OPT_CRASH_LOOP_FILE},
+    {"crash-loop-release-path", required_argument, 0, OPT_CRASH_LOOP_RELEASE_PATH},
+    {"cmd-timeout", required_argument, 0, OPT_CMD_TIMEOUT},
+    {"mount-wait", required_argument, 0, OPT_MOUNT_WAIT},
+    {"tmpfs", required_argument, 0, OPT_TMPFS},
+    {"zram", required_argument, 0, OPT_ZRAM},
     {0,     0,      0, 0 }
 };
 
@@ -233,6 +290,83 @@ void parse_args(int argc, char *argv[])
         case OPT_CORE_PATTERN: // --core-pattern
             SET_STRING_OPTION(options.core_pattern);
             break;
+        case OPT_TRACE_FILE: // --trace-file /root/trace.json
+            SET_STRING_OPTION(options.trace_file);
+            break;
+        case OPT_PARALLEL_BOOT: // --parallel-boot
+            options.parallel_boot = 1;
+            break;
+        case OPT_DEFER_NONCRITICAL: // --defer-noncritical
+            options.defer_noncritical = 1;
+            break;
+        case OPT_DEFER_ROOTDISK_SYMLINKS: // --defer-rootdisk-symlinks
+            options.defer_rootdisk_symlinks = 1;
+            break;
+        case OPT_RELEASE_CACHE: // --release-cache /root/release_cache
+            SET_STRING_OPTION(options.release_cache);
+            break;
+        case OPT_RELEASE_MANIFEST: // --release-manifest /srv/erlang/erlinit.manifest
+            SET_STRING_OPTION(options.release_manifest);
+            break;
+        case OPT_PREWARM_CODE: // --prewarm-code
+            options.prewarm_code = 1;
+            break;
+        case OPT_READAHEAD_LIST: // --readahead-list /root/readahead.list
+            SET_STRING_OPTION(options.readahead_list);
+            break;
+        case OPT_READAHEAD_RECORD: // --readahead-record 30
+            options.readahead_record_secs = strtol(optarg, NULL, 0);
+            break;
+        case OPT_SIGTERM_TIMEOUT: // --sigterm-timeout 1000
+            options.sigterm_timeout_ms = strtol(optarg, NULL, 0);
+            break;
+        case OPT_RESTART_VM: // --restart-vm 3:10
+            if (sscanf(optarg, "%d:%d", &options.vm_restart_limit, &options.vm_restart_window_minutes) != 2 ||
+                options.vm_restart_limit < 0 ||
+                options.vm_restart_window_minutes <= 0) {
+                elog(ELOG_WARNING, "Ignoring invalid --restart-vm '%s'", optarg);
+                options.vm_restart_limit = 0;
+            }
+            break;
+        case OPT_CRASH_LOOP: // --crash-loop 3:60
+            if (sscanf(optarg, "%d:%d", &options.crash_loop_limit, &options.crash_loop_seconds) != 2 ||
+                options.crash_loop_limit < 0 ||
+                options.crash_loop_seconds <= 0) {
+                elog(ELOG_WARNING, "Ignoring invalid --crash-loop '%s'", optarg);
+                options.crash_loop_limit = 0;
+            }
+            break;
+        case OPT_CRASH_LOOP_FILE: // --crash-loop-file /root/erlinit_crash_loop
+            SET_STRING_OPTION(options.crash_loop_file);
+            break;
+        case OPT_CRASH_LOOP_RELEASE_PATH: // --crash-loop-release-path /srv/erlang-fallback
+            SET_STRING_OPTION(options.crash_loop_release_path);
+            break;
+        case OPT_CMD_TIMEOUT: // --cmd-timeout 5000
+            options.cmd_timeout_ms = strtol(optarg, NULL, 0);
+            break;
+        case OPT_MOUNT_WAIT: // --mount-wait 2000
+            options.mount_wait_ms = strtol(optarg, NULL, 0);
+            break;
+        case OPT_TMPFS: // --tmpfs /tmp:size=25%,max=32m
+            if (strncmp(optarg, "default:", 8) == 0 ||
+                    strncmp(optarg, "/tmp:", 5) == 0 ||
+                    strncmp(optarg, "/run:", 5) == 0 ||
+                    strncmp(optarg, "overlay:", 8) == 0) {
+                APPEND_STRING_OPTION(options.tmpfs, ';');
+            } else {
+                elog(ELOG_WARNING, "Ignoring invalid --tmpfs '%s'", optarg);
+            }
+            break;
+        case OPT_ZRAM: // --zram swap:50%:algorithm=zstd,priority=100
+            if (strncmp(optarg, "swap:", 5) == 0 ||
+                    strncmp(optarg, "/tmp:", 5) == 0 ||
+                    strncmp(optarg, "overlay:", 8) == 0) {
+                APPEND_STRING_OPTION(options.zram, ';');
+            } else {
+                elog(ELOG_WARNING, "Ignoring invalid --zram '%s'", optarg);
+            }
+            break;
         default:
             // getopt prints a warning, so we don't have to
             break;
@@ -0,0 +1,236 @@
+// SPDX-FileCopyrightText: 2026 Frank Hunleth
+//
+// SPDX-License-Identifier: MIT
+//
+
+#include "erlinit.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef __APPLE__
+#include <sys/fanotify.h>
+#endif
+
+// Record and replay the files that the Erlang VM reads when it starts.
+//
+// When recording, a helper process watches opens with fanotify for a while
+// after erlexec starts and saves the paths in first access order, one per
+// line. On later boots, a helper process asks the kernel to read in each
+// file on the list while erlexec starts.
+
+#define MAX_READAHEAD_FILES 4096
+#define READAHEAD_HASH_SIZE (2 * MAX_READAHEAD_FILES)
+
+int readahead_file(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    // This starts reading the file in and returns right away
+    (void) posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+    return 0;
+}
+
+static void replay(const char *list_path)
+{
+    FILE *fp = fopen(list_path, "r");
+    if (!fp) {
+        elog(ELOG_DEBUG, "No readahead list at %s", list_path);
+        return;
+    }
+
+    char line[ERLINIT_PATH_MAX];
+    int count = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '/' && readahead_file(line) == 0)
+            count++;
+    }
+    fclose(fp);
+
+    elog(ELOG_DEBUG, "Read ahead %d files from %s", count, list_path);
+}
+
+void readahead_start_replay(const char *list_path)
+{
+    if (fork_detached() == 0) {
+        replay(list_path);
+        exit(EXIT_SUCCESS);
+    }
+}
+
+#ifndef __APPLE__
+struct recording {
+    char *paths[MAX_READAHEAD_FILES];
+    int hash[READAHEAD_HASH_SIZE]; // index + 1 into paths or 0 if empty
+    int count;
+};
+
+static unsigned int hash_path(const char *path)
+{
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (; *path; path++)
+        hash = (hash ^ (unsigned char) *path) * 16777619u;
+    return hash;
+}
+
+static void record_path(struct recording *r, const char *path)
+{
+    // Pseudo-filesystems don't use the page cache
+    if (strncmp(path, "/proc/", 6) == 0 ||
+            strncmp(path, "/sys/", 5) == 0 ||
+            strncmp(path, "/dev/", 5) == 0)
+        return;
+
+    if (r->count == MAX_READAHEAD_FILES)
+        return;
+
+    unsigned int slot = hash_path(path) % READAHEAD_HASH_SIZE;
+    while (r->hash[slot]) {
+        if (strcmp(r->paths[r->hash[slot] - 1], path) == 0)
+            return;
+        slot = (slot + 1) % READAHEAD_HASH_SIZE;
+    }
+
+    r->paths[r->count] = strdup(path);
+    r->count++;
+    r->hash[slot] = r->count;
+}
+
+static int record_events(int fan_fd, struct recording *r)
+{
+    // fanotify events need to be aligned like the metadata struct
+    char buffer[4096] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+    ssize_t len = read(fan_fd, buffer, sizeof(buffer));
+    if (len <= 0)
+        return -1;
+
+    const struct fanotify_event_metadata *event = (const struct fanotify_event_metadata *) buffer;
+    for (; FAN_EVENT_OK(event, len); event = FAN_EVENT_NEXT(event, len)) {
+        if (event->vers != FANOTIFY_METADATA_VERSION)
+            return -1;
+        if (event->fd < 0)
+            continue;
+
+        char proc_path[64];
+        char path[ERLINIT_PATH_MAX];
+        snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", event->fd);
+        ssize_t path_len = readlink(proc_path, path, sizeof(path) - 1);
+        if (path_len > 0 && event->pid != getpid()) {
+            path[path_len] = '\0';
+            record_path(r, path);
+        }
+        close(event->fd);
+    }
+    return 0;
+}
+
+static void save_recording(const char *list_path, const struct recording *r)
+{
+    FILE *fp = fopen(list_path, "w");
+    if (!fp) {
+        elog(ELOG_WARNING, "Cannot write readahead list %s: %s", list_path, strerror(errno));
+        return;
+    }
+
+    for (int i = 0; i < r->count; i++) {
+        if (strcmp(r->paths[i], list_path) != 0)
+            fprintf(fp, "%s\n", r->paths[i]);
+    }
+    fclose(fp);
+
+    elog(ELOG_INFO, "Recorded %d files to %s", r->count, list_path);
+}
+
+static void record(const char *list_path, int seconds, const struct erl_run_info *run_info, int ready_fd)
+{
+    int fan_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC, O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+    if (fan_fd < 0) {
+        elog(ELOG_WARNING, "Cannot record readahead list: fanotify_init failed: %s", strerror(errno));
+        return;
+    }
+
+    // The release and ERTS could be on different mounts than the root
+    const char *mounts[] = {"/", run_info->release_base_dir, run_info->erts_dir};
+    for (size_t i = 0; i < sizeof(mounts) / sizeof(mounts[0]); i++) {
+        if (mounts[i] &&
+                fanotify_mark(fan_fd, FAN_MARK_ADD | FAN_MARK_MOUNT, FAN_OPEN, AT_FDCWD, mounts[i]) < 0)
+            elog(ELOG_WARNING, "Cannot watch %s for readahead: %s", mounts[i], strerror(errno));
+    }
+
+    // Let erlexec start
+    close(ready_fd);
+
+    struct recording *r = calloc(1, sizeof(struct recording));
+    if (!r) {
+        elog(ELOG_WARNING, "Cannot record readahead list: out of memory");
+        close(fan_fd);
+        return;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (elapsed_ms >= seconds * 1000)
+            break;
+
+        struct pollfd fdset = {fan_fd, POLLIN, 0};
+        int rc = poll(&fdset, 1, seconds * 1000 - elapsed_ms);
+        if (rc < 0 && errno != EINTR)
+            break;
+        if (rc > 0 && record_events(fan_fd, r) < 0)
+            break;
+    }
+    close(fan_fd);
+
+    save_recording(list_path, r);
+}
+
+void readahead_start_recording(const char *list_path, int seconds, const struct erl_run_info *run_info)
+{
+    int ready_pipe[2];
+    if (pipe(ready_pipe) < 0) {
+        elog(ELOG_WARNING, "Cannot record readahead list: %s", strerror(errno));
+        return;
+    }
+
+    int rc = fork_detached();
+    if (rc == 0) {
+        close(ready_pipe[0]);
+        record(list_path, seconds, run_info, ready_pipe[1]);
+        exit(EXIT_SUCCESS);
+    }
+    close(ready_pipe[1]);
+
+    // Wait for the recorder to start watching so that nothing that
+    // erlexec opens gets missed. The read returns when the recorder
+    // closes its end of the pipe either on success or failure.
+    if (rc > 0) {
+        char c;
+        while (read(ready_pipe[0], &c, 1) < 0 && errno == EINTR)
+            ;
+    }
+    close(ready_pipe[0]);
+}
+#else
+void readahead_start_recording(const char *list_path, int seconds, const struct erl_run_info *run_info)
+{
+    (void) list_path;
+    (void) seconds;
+    (void) run_info;
+    elog(ELOG_WARNING, "Recording readahead lists isn't supported");
+}
+#endif
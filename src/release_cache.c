@@ -0,0 +1,300 @@
+// SPDX-FileCopyrightText: 2026 Frank Hunleth
+//
+// SPDX-License-Identifier: MIT
+//
+
+#include "erlinit.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// The release cache saves the results of searching for the release so that
+// the next boot can skip the scandir and stat calls. It's a text file with
+// one "key=value" per line. The "check" lines have the inode, mtime and ctime
+// of the directories and files that the search depended on. If any of those
+// changed or the options that affect the search changed, the cache is
+// ignored and the release is found the normal way.
+//
+// The last line is "end" so that a partially written cache is ignored.
+//
+// Release manifests use the same format, but don't have "check" lines. They
+// are created when building firmware by running `erlinit --resolve-release`.
+
+#define RELEASE_CACHE_HEADER "erlinit-release-cache 1"
+#define RELEASE_MANIFEST_HEADER "erlinit-release-manifest 1"
+#define MAX_CACHE_LINE (ERLINIT_PATH_MAX + 64)
+#define MAX_CACHE_CHECKS 32
+
+struct run_info_field {
+    const char *key;
+    size_t offset;
+};
+
+static const struct run_info_field run_info_fields[] = {
+    {"release_base_dir", offsetof(struct erl_run_info, release_base_dir)},
+    {"releases_version_dir", offsetof(struct erl_run_info, releases_version_dir)},
+    {"consolidated_protocols_path", offsetof(struct erl_run_info, consolidated_protocols_path)},
+    {"release_name", offsetof(struct erl_run_info, release_name)},
+    {"erts_version", offsetof(struct erl_run_info, erts_version)},
+    {"erts_dir", offsetof(struct erl_run_info, erts_dir)},
+    {"boot_path", offsetof(struct erl_run_info, boot_path)},
+    {"sys_config", offsetof(struct erl_run_info, sys_config)},
+    {"vmargs_path", offsetof(struct erl_run_info, vmargs_path)},
+    {NULL, 0}
+};
+
+static char **run_info_field(struct erl_run_info *run_info, const struct run_info_field *field)
+{
+    return (char **) ((char *) run_info + field->offset);
+}
+
+void free_run_info(struct erl_run_info *run_info)
+{
+    for (const struct run_info_field *f = run_info_fields; f->key; f++) {
+        char **value = run_info_field(run_info, f);
+        free(*value);
+    }
+    memset(run_info, 0, sizeof(struct erl_run_info));
+}
+
+static void options_key(char *key, size_t len)
+{
+    // Everything that changes the result of find_release() and
+    // find_erts_directory() besides the filesystem contents
+    snprintf(key, len, "%s|%s|%d",
+             options.release_search_path ? options.release_search_path : DEFAULT_RELEASE_ROOT_DIR,
+             options.boot_path ? options.boot_path : "",
+             options.release_include_erts);
+}
+
+void release_check_format(char *line, size_t len, const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) < 0)
+        memset(&st, 0, sizeof(st));
+
+    snprintf(line, len, "%llu %lld.%09ld %lld.%09ld %s",
+             (unsigned long long) st.st_ino,
+             (long long) st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+             (long long) st.st_ctim.tv_sec, st.st_ctim.tv_nsec,
+             path);
+}
+
+int release_check_matches(const char *check)
+{
+    const char *path = strchr(check, '/');
+    if (path == NULL)
+        return 0;
+
+    char line[MAX_CACHE_LINE];
+    release_check_format(line, sizeof(line), path);
+    return strcmp(line, check) == 0;
+}
+
+static int add_check(char **checks, int num_checks, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static int add_check(char **checks, int num_checks, const char *fmt, ...)
+{
+    if (num_checks == MAX_CACHE_CHECKS)
+        return num_checks;
+
+    va_list ap;
+    va_start(ap, fmt);
+    int rc = vasprintf(&checks[num_checks], fmt, ap);
+    va_end(ap);
+
+    return rc < 0 ? num_checks : num_checks + 1;
+}
+
+static int release_checks(const struct erl_run_info *run_info, char **checks)
+{
+    int n = 0;
+
+    // Releases are searched for in order, so adding one to any of these
+    // directories could change the result.
+    const char *search_path = options.release_search_path ? options.release_search_path : DEFAULT_RELEASE_ROOT_DIR;
+    const char *start = search_path;
+    while (*start) {
+        size_t len = strcspn(start, ":");
+        if (len > 0)
+            n = add_check(checks, n, "%.*s", (int) len, start);
+        start += len;
+        if (*start == ':')
+            start++;
+    }
+
+    n = add_check(checks, n, "%s", run_info->release_base_dir);
+    n = add_check(checks, n, "%s/releases", run_info->release_base_dir);
+    n = add_check(checks, n, "%s/releases/start_erl.data", run_info->release_base_dir);
+    n = add_check(checks, n, "%s", run_info->releases_version_dir);
+    n = add_check(checks, n, "%s/lib", run_info->release_base_dir);
+    n = add_check(checks, n, "%s", ERLANG_ROOT_DIR);
+    n = add_check(checks, n, "%s", run_info->erts_dir);
+    return n;
+}
+
+static int load_run_info(FILE *fp, const char *header, struct erl_run_info *run_info)
+{
+    char key[MAX_CACHE_LINE];
+    options_key(key, sizeof(key));
+
+    char line[MAX_CACHE_LINE];
+    int valid = 0;
+    int lineno = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        lineno++;
+
+        if (lineno == 1) {
+            if (strcmp(line, header) != 0)
+                break;
+            continue;
+        }
+
+        if (strcmp(line, "end") == 0) {
+            valid = 1;
+            break;
+        }
+
+        char *value = strchr(line, '=');
+        if (value == NULL)
+            break;
+        *value++ = '\0';
+
+        if (strcmp(line, "options") == 0) {
+            if (strcmp(value, key) != 0)
+                break;
+        } else if (strcmp(line, "check") == 0) {
+            if (!release_check_matches(value))
+                break;
+        } else {
+            const struct run_info_field *f;
+            for (f = run_info_fields; f->key; f++) {
+                if (strcmp(line, f->key) == 0) {
+                    char **field = run_info_field(run_info, f);
+                    free(*field);
+                    *field = strdup(value);
+                    break;
+                }
+            }
+            if (f->key == NULL)
+                break;
+        }
+    }
+
+    if (!valid || run_info->releases_version_dir == NULL || run_info->erts_dir == NULL) {
+        free_run_info(run_info);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void write_run_info(FILE *fp, const struct erl_run_info *run_info)
+{
+    for (const struct run_info_field *f = run_info_fields; f->key; f++) {
+        char *value = *run_info_field((struct erl_run_info *) run_info, f);
+        if (value)
+            fprintf(fp, "%s=%s\n", f->key, value);
+    }
+    fprintf(fp, "end\n");
+}
+
+int release_cache_load(const char *path, struct erl_run_info *run_info)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        elog(ELOG_DEBUG, "No release cache at %s", path);
+        return -1;
+    }
+
+    int rc = load_run_info(fp, RELEASE_CACHE_HEADER, run_info);
+    fclose(fp);
+
+    if (rc < 0)
+        elog(ELOG_DEBUG, "Release cache %s is out of date", path);
+    else
+        elog(ELOG_DEBUG, "Using release in %s from cache.", run_info->releases_version_dir);
+    return rc;
+}
+
+void release_cache_save(const char *path, const struct erl_run_info *run_info)
+{
+    // Only cache successful searches
+    if (run_info->releases_version_dir == NULL || run_info->erts_dir == NULL)
+        return;
+
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        elog(ELOG_WARNING, "Cannot write release cache %s: %s", path, strerror(errno));
+        return;
+    }
+
+    char key[MAX_CACHE_LINE];
+    options_key(key, sizeof(key));
+    fprintf(fp, RELEASE_CACHE_HEADER "\n");
+    fprintf(fp, "options=%s\n", key);
+
+    char *checks[MAX_CACHE_CHECKS];
+    int num_checks = release_checks(run_info, checks);
+    for (int i = 0; i < num_checks; i++) {
+        char line[MAX_CACHE_LINE];
+        release_check_format(line, sizeof(line), checks[i]);
+        fprintf(fp, "check=%s\n", line);
+        free(checks[i]);
+    }
+
+    write_run_info(fp, run_info);
+    fclose(fp);
+}
+
+int release_manifest_load(const char *path, struct erl_run_info *run_info)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        elog(ELOG_WARNING, "Release manifest %s not found. Searching for release.", path);
+        return -1;
+    }
+
+    int rc = load_run_info(fp, RELEASE_MANIFEST_HEADER, run_info);
+    fclose(fp);
+
+    if (rc < 0)
+        elog(ELOG_WARNING, "Release manifest %s doesn't match options. Searching for release.", path);
+    else
+        elog(ELOG_DEBUG, "Using release in %s from manifest.", run_info->releases_version_dir);
+    return rc;
+}
+
+int release_manifest_save(const char *path, const struct erl_run_info *run_info)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        elog(ELOG_ERROR, "Cannot write release manifest %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    char key[MAX_CACHE_LINE];
+    options_key(key, sizeof(key));
+    fprintf(fp, RELEASE_MANIFEST_HEADER "\n");
+    fprintf(fp, "options=%s\n", key);
+    write_run_info(fp, run_info);
+    fclose(fp);
+    return 0;
+}
+
+void run_info_strip_prefix(struct erl_run_info *run_info, const char *prefix)
+{
+    size_t len = strlen(prefix);
+    for (const struct run_info_field *f = run_info_fields; f->key; f++) {
+        char *value = *run_info_field(run_info, f);
+        if (value && strncmp(value, prefix, len) == 0 && value[len] == '/')
+            memmove(value, value + len, strlen(value + len) + 1);
+    }
+}
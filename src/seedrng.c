@@ -426,42 +426,65 @@ static bool skip_credit(void)
 			!strcasecmp(skip, "yes") || !strcasecmp(skip, "y"));
 }
 
-int seedrng(void)
+// State kept between seedrng_load() and seedrng_save() so that saving the
+// new seed can happen later and in another process.
+static int seed_dfd = -1;
+static int seed_program_ret = 0;
+static struct blake2s_state seed_hash;
+
+int seedrng_load(void)
 {
 	static const char seedrng_prefix[] = "SeedRNG v1 Old+New Prefix";
-	static const char seedrng_failure[] = "SeedRNG v1 No New Seed Failure";
-	int fd = -1, dfd = -1, program_ret = 0;
-	uint8_t new_seed[MAX_SEED_LEN];
-	size_t new_seed_len;
-	bool new_seed_creditable;
 	struct timespec realtime = { 0 }, boottime = { 0 };
-	struct blake2s_state hash;
 
 	umask(0077);
 
-	blake2s_init(&hash, BLAKE2S_HASH_LEN);
-	blake2s_update(&hash, seedrng_prefix, strlen(seedrng_prefix));
+	blake2s_init(&seed_hash, BLAKE2S_HASH_LEN);
+	blake2s_update(&seed_hash, seedrng_prefix, strlen(seedrng_prefix));
 	clock_gettime(CLOCK_REALTIME, &realtime);
 	clock_gettime(CLOCK_BOOTTIME, &boottime);
-	blake2s_update(&hash, &realtime, sizeof(realtime));
-	blake2s_update(&hash, &boottime, sizeof(boottime));
+	blake2s_update(&seed_hash, &realtime, sizeof(realtime));
+	blake2s_update(&seed_hash, &boottime, sizeof(boottime));
 
+	seed_program_ret = 0;
 	if (mkdir(SEED_DIR, 0700) < 0 && errno != EEXIST) {
 		elog(ELOG_WARNING, "Unable to create seed directory");
-		return 1;
+		seed_program_ret = 1;
+		return seed_program_ret;
 	}
 
-	dfd = open(SEED_DIR, O_DIRECTORY | O_RDONLY);
-	if (dfd < 0 || flock(dfd, LOCK_EX) < 0) {
+	// The lock is held until seedrng_save(). O_CLOEXEC keeps it from
+	// leaking into Erlang when the save is deferred.
+	seed_dfd = open(SEED_DIR, O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+	if (seed_dfd < 0 || flock(seed_dfd, LOCK_EX) < 0) {
 		elog(ELOG_WARNING, "Unable to lock seed directory");
-		program_ret = 1;
-		goto out;
+		seed_program_ret = 1;
+		if (seed_dfd >= 0) {
+			close(seed_dfd);
+			seed_dfd = -1;
+		}
+		return seed_program_ret;
 	}
 
-	if (seed_from_file_if_exists(NON_CREDITABLE_SEED, dfd, false, &hash) < 0)
-		program_ret |= 1 << 1;
-	if (seed_from_file_if_exists(CREDITABLE_SEED, dfd, !skip_credit(), &hash) < 0)
-		program_ret |= 1 << 2;
+	if (seed_from_file_if_exists(NON_CREDITABLE_SEED, seed_dfd, false, &seed_hash) < 0)
+		seed_program_ret |= 1 << 1;
+	if (seed_from_file_if_exists(CREDITABLE_SEED, seed_dfd, !skip_credit(), &seed_hash) < 0)
+		seed_program_ret |= 1 << 2;
+
+	return seed_program_ret;
+}
+
+int seedrng_save(void)
+{
+	static const char seedrng_failure[] = "SeedRNG v1 No New Seed Failure";
+	int fd = -1, dfd = seed_dfd, program_ret = seed_program_ret;
+	uint8_t new_seed[MAX_SEED_LEN];
+	size_t new_seed_len;
+	bool new_seed_creditable;
+
+	seed_dfd = -1;
+	if (dfd < 0)
+		return program_ret;
 
 	new_seed_len = determine_optimal_seed_len();
 	if (read_new_seed(new_seed, new_seed_len, &new_seed_creditable) < 0) {
@@ -470,9 +493,9 @@ int seedrng(void)
 		strncpy((char *)new_seed, seedrng_failure, new_seed_len);
 		program_ret |= 1 << 3;
 	}
-	blake2s_update(&hash, &new_seed_len, sizeof(new_seed_len));
-	blake2s_update(&hash, new_seed, new_seed_len);
-	blake2s_final(&hash, new_seed + new_seed_len - BLAKE2S_HASH_LEN);
+	blake2s_update(&seed_hash, &new_seed_len, sizeof(new_seed_len));
+	blake2s_update(&seed_hash, new_seed, new_seed_len);
+	blake2s_final(&seed_hash, new_seed + new_seed_len - BLAKE2S_HASH_LEN);
 
 	elog(ELOG_DEBUG, "Saving %zu bits of %s seed for next boot", new_seed_len * 8, new_seed_creditable ? "creditable" : "non-creditable");
 	fd = openat(dfd, NON_CREDITABLE_SEED, O_WRONLY | O_CREAT | O_TRUNC, 0400);
@@ -493,7 +516,12 @@ int seedrng(void)
 out:
 	if (fd >= 0)
 		close(fd);
-	if (dfd >= 0)
-		close(dfd);
+	close(dfd);
 	return program_ret;
 }
+
+int seedrng(void)
+{
+	seedrng_load();
+	return seedrng_save();
+}
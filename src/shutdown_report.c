@@ -36,8 +36,8 @@ static const char *yes_or_no(int value)
 
 static double delta_seconds(const struct timespec *ts1, const struct timespec *ts2)
 {
-    double first = ts1->tv_sec + ts1->tv_nsec * 0.0000000001;
-    double second = ts2->tv_sec + ts2->tv_nsec * 0.0000000001;
+    double first = ts1->tv_sec + ts1->tv_nsec * 0.000000001;
+    double second = ts2->tv_sec + ts2->tv_nsec * 0.000000001;
     return second - first;
 }
 
@@ -87,12 +87,30 @@ static void report_exit_info(FILE *fp, const struct erlinit_exit_info *exit_info
     fprintf(fp, "Shutdown action: %s\n", reboot_cmd(exit_info->desired_reboot_cmd));
     if (exit_info->reboot_args[0] != '\0')
         fprintf(fp, "Reboot args: %s\n", (const char *) exit_info->reboot_args);
+    fprintf(fp, "Kill all time: sync %.3f s, SIGTERM %.3f s, SIGKILL %.3f s\n",
+            delta_seconds(&exit_info->kill_start, &exit_info->kill_synced),
+            delta_seconds(&exit_info->kill_synced, &exit_info->kill_termed),
+            delta_seconds(&exit_info->kill_termed, &exit_info->kill_complete));
+    if (exit_info->processes_after_sigterm > 0)
+        fprintf(fp, "Processes left after SIGTERM: %d\n", exit_info->processes_after_sigterm);
+    for (int i = 0; i < exit_info->num_fs_syncs; i++) {
+        const struct fs_sync_report *sync_report = &exit_info->fs_syncs[i];
+        if (sync_report->duration_us >= 0)
+            fprintf(fp, "Flush time for %s: %.3f s\n", sync_report->target, sync_report->duration_us / 1000000.0);
+        else
+            fprintf(fp, "Flush time for %s: failed\n", sync_report->target);
+    }
+    fprintf(fp, "Orphans reaped: %lu in %lu wakeups (max %u at once)\n",
+            exit_info->orphans_reaped, exit_info->reap_wakeups, exit_info->max_reap_batch);
+    fprintf(fp, "Erlang VM restarts: %d\n", exit_info->vm_restarts);
 }
 
-static void report_dmesg(FILE *fp)
-{
-    fprintf(fp, "\n## dmesg\n\n");
+// dmesg can be collected early while shutdown is waiting on other things
+static char *collected_dmesg = NULL;
+static size_t collected_dmesg_len = 0;
 
+static void read_dmesg(FILE *fp)
+{
     int fd = open("/dev/kmsg", O_RDONLY | O_NONBLOCK);
     if (fd < 0) {
         fprintf(fp, "Error opening /dev/kmsg: %s\n", strerror(errno));
@@ -126,6 +144,26 @@ static void report_dmesg(FILE *fp)
     fprintf(fp, "```\n");
 }
 
+void shutdown_report_collect_dmesg()
+{
+    FILE *fp = open_memstream(&collected_dmesg, &collected_dmesg_len);
+    if (fp == NULL)
+        return;
+
+    read_dmesg(fp);
+    fclose(fp);
+}
+
+static void report_dmesg(FILE *fp)
+{
+    fprintf(fp, "\n## dmesg\n\n");
+
+    if (collected_dmesg)
+        fwrite(collected_dmesg, 1, collected_dmesg_len, fp);
+    else
+        read_dmesg(fp);
+}
+
 void shutdown_report_create(const char *path, const struct erlinit_exit_info *exit_info)
 {
     elog(ELOG_DEBUG, "Writing shutdown report to '%s'", path);
@@ -145,6 +183,10 @@ void shutdown_report_create(const char *path, const struct erlinit_exit_info *ex
 
     report_dmesg(fp);
 
+    fprintf(fp, "\n## erlinit log\n\n```\n");
+    log_report(fp);
+    fprintf(fp, "```\n");
+
     fclose(fp);
 }
 
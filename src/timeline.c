@@ -0,0 +1,244 @@
+// SPDX-FileCopyrightText: 2026 Frank Hunleth
+//
+// SPDX-License-Identifier: MIT
+//
+
+#include "erlinit.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TIMELINE_PATH ERLINIT_RUN_DIR "/boot_timeline"
+
+// Enough for every stage in main() and child() and the shutdown with room to spare
+#define MAX_TIMELINE_STAGES 64
+
+struct timeline_stage {
+    const char *name;
+    const char *detail;
+    pid_t pid;
+    struct timespec mono_start;
+    struct timespec mono_end;
+    struct timespec boot_start;
+};
+
+static struct timespec erlinit_mono_start;
+static struct timespec erlinit_boot_start;
+static struct timeline_stage stages[MAX_TIMELINE_STAGES];
+static int num_stages = 0;
+
+// Stages before this one were already written to the trace file by this
+// process or, for the PID 1 process, by the child process.
+static int first_untraced_stage = 0;
+
+static int timeline_enabled()
+{
+    return options.print_timing || options.trace_file;
+}
+
+static long long to_us(const struct timespec *ts)
+{
+    return (long long) ts->tv_sec * 1000000LL + ts->tv_nsec / 1000;
+}
+
+static long long delta_us(const struct timespec *start, const struct timespec *end)
+{
+    return to_us(end) - to_us(start);
+}
+
+void timeline_init()
+{
+    // Always capture when erlinit started since options haven't been parsed
+    // yet. CLOCK_BOOTTIME shows how long the kernel took to get here.
+    clock_gettime(CLOCK_MONOTONIC, &erlinit_mono_start);
+    clock_gettime(CLOCK_BOOTTIME, &erlinit_boot_start);
+}
+
+int timeline_begin(const char *stage)
+{
+    return timeline_begin_detail(stage, NULL);
+}
+
+int timeline_begin_detail(const char *stage, const char *detail)
+{
+    if (!timeline_enabled() || num_stages == MAX_TIMELINE_STAGES)
+        return -1;
+
+    struct timeline_stage *s = &stages[num_stages];
+    s->name = stage;
+    s->detail = detail;
+    s->pid = getpid();
+    clock_gettime(CLOCK_MONOTONIC, &s->mono_start);
+    clock_gettime(CLOCK_BOOTTIME, &s->boot_start);
+    s->mono_end = s->mono_start;
+
+    return num_stages++;
+}
+
+void timeline_set_pid(int stage, pid_t pid)
+{
+    if (stage < 0)
+        return;
+
+    stages[stage].pid = pid;
+}
+
+void timeline_end(int stage)
+{
+    if (stage < 0)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &stages[stage].mono_end);
+}
+
+long long timeline_duration_us(int stage)
+{
+    if (stage < 0)
+        return 0;
+
+    return delta_us(&stages[stage].mono_start, &stages[stage].mono_end);
+}
+
+void timeline_forked()
+{
+    // The child process saves everything recorded up to the fork, so the
+    // parent only needs to save what happens afterwards.
+    first_untraced_stage = num_stages;
+}
+
+void timeline_save()
+{
+    if (!options.print_timing)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long total_us = delta_us(&erlinit_mono_start, &now);
+
+    const struct timeline_stage *slowest = NULL;
+    for (int i = 0; i < num_stages; i++) {
+        if (slowest == NULL ||
+                delta_us(&stages[i].mono_start, &stages[i].mono_end) >
+                delta_us(&slowest->mono_start, &slowest->mono_end))
+            slowest = &stages[i];
+    }
+
+    if (slowest)
+        elog(ELOG_PMSG_ONLY, "Boot timeline: %lld us to erlexec, slowest stage %s (%lld us)",
+             total_us, slowest->name, delta_us(&slowest->mono_start, &slowest->mono_end));
+
+    // /run is a tmpfs, so this only gets created once per boot.
+    if (mkdir(ERLINIT_RUN_DIR, 0755) < 0 && errno != EEXIST) {
+        elog(ELOG_WARNING, "Cannot create %s: %s", ERLINIT_RUN_DIR, strerror(errno));
+        return;
+    }
+
+    FILE *fp = fopen(TIMELINE_PATH, "w");
+    if (fp == NULL) {
+        elog(ELOG_WARNING, "Cannot write %s: %s", TIMELINE_PATH, strerror(errno));
+        return;
+    }
+
+    // Times are in microseconds. Start times are relative to when erlinit
+    // started. Boottime is the CLOCK_BOOTTIME at the start of the stage.
+    fprintf(fp, "# stage start_us duration_us boottime_us\n");
+    fprintf(fp, "erlinit 0 0 %lld\n", to_us(&erlinit_boot_start));
+    for (int i = 0; i < num_stages; i++) {
+        const struct timeline_stage *s = &stages[i];
+        fprintf(fp, "%s %lld %lld %lld\n",
+                s->name,
+                delta_us(&erlinit_mono_start, &s->mono_start),
+                delta_us(&s->mono_start, &s->mono_end),
+                to_us(&s->boot_start));
+    }
+    fprintf(fp, "erlexec %lld 0 %lld\n",
+            total_us, to_us(&erlinit_boot_start) + total_us);
+    fclose(fp);
+}
+
+static void json_string(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(fp, "\\%c", *s);
+        else if ((unsigned char) *s < 0x20)
+            fprintf(fp, "\\u%04x", *s);
+        else
+            fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+static void trace_event_separator(FILE *fp, int *first_event)
+{
+    if (*first_event)
+        *first_event = 0;
+    else
+        fprintf(fp, ",\n");
+}
+
+void timeline_save_trace(int new_trace)
+{
+    if (!options.trace_file)
+        return;
+
+    // This uses the Trace Event Format's JSON array form since it can be
+    // appended to by both the PID 1 and child processes. The closing ']' is
+    // optional and left off for the same reason.
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (new_trace ? O_TRUNC : O_APPEND);
+    int fd = open(options.trace_file, flags, 0644);
+    if (fd < 0) {
+        elog(ELOG_WARNING, "Cannot write trace to %s: %s", options.trace_file, strerror(errno));
+        return;
+    }
+
+    struct stat st;
+    int first_event = (fstat(fd, &st) == 0 && st.st_size == 0);
+
+    FILE *fp = fdopen(fd, "a");
+    if (fp == NULL) {
+        close(fd);
+        return;
+    }
+
+    if (first_event) {
+        fprintf(fp, "[\n");
+        trace_event_separator(fp, &first_event);
+        fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"erlinit\"}}");
+    }
+
+    if (getpid() != 1) {
+        trace_event_separator(fp, &first_event);
+        fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"erlinit child\"}}",
+                (int) getpid());
+    }
+
+    for (int i = first_untraced_stage; i < num_stages; i++) {
+        const struct timeline_stage *s = &stages[i];
+        trace_event_separator(fp, &first_event);
+        fprintf(fp, "{\"name\":");
+        json_string(fp, s->name);
+        fprintf(fp, ",\"cat\":\"erlinit\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d",
+                to_us(&s->mono_start),
+                delta_us(&s->mono_start, &s->mono_end),
+                (int) s->pid,
+                (int) s->pid);
+        if (s->detail) {
+            fprintf(fp, ",\"args\":{\"cmd\":");
+            json_string(fp, s->detail);
+            fprintf(fp, "}");
+        }
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "\n");
+    fclose(fp);
+
+    first_untraced_stage = num_stages;
+}
@@ -0,0 +1,110 @@
+// SPDX-FileCopyrightText: 2026 Frank Hunleth
+//
+// SPDX-License-Identifier: MIT
+//
+
+#include "erlinit.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Options for the tmpfs mounts that erlinit makes itself. Each mount starts
+// with erlinit's defaults, then the "default" --tmpfs entries and then the
+// entries for that mount. Later options replace earlier ones.
+//
+// Everything is passed to the kernel as is except for "min" and "max".
+// When either is set, erlinit works out the size itself and clamps it so
+// that percentages work on boards with very different amounts of RAM.
+
+struct tmpfs_size {
+    char size[32];
+    char min[32];
+    char max[32];
+};
+
+static void append_option(char *result, size_t len, const char *opt)
+{
+    size_t used = strlen(result);
+    snprintf(result + used, len - used, "%s%s", used > 0 ? "," : "", opt);
+}
+
+static void add_options(const char *str, size_t str_len, struct tmpfs_size *size, char *result, size_t len)
+{
+    char *opts = strndup(str, str_len);
+    char *temp = opts;
+    const char *opt;
+    while ((opt = strsep(&temp, ",")) != NULL) {
+        if (strncmp(opt, "size=", 5) == 0)
+            snprintf(size->size, sizeof(size->size), "%s", opt + 5);
+        else if (strncmp(opt, "min=", 4) == 0)
+            snprintf(size->min, sizeof(size->min), "%s", opt + 4);
+        else if (strncmp(opt, "max=", 4) == 0)
+            snprintf(size->max, sizeof(size->max), "%s", opt + 4);
+        else if (*opt != '\0')
+            append_option(result, len, opt);
+    }
+    free(opts);
+}
+
+static void add_entries(const char *name, struct tmpfs_size *size, char *result, size_t len)
+{
+    // --tmpfs entries are stored as "name:options;name:options"
+    size_t name_len = strlen(name);
+    const char *entry = options.tmpfs;
+    while (entry) {
+        const char *next = strchr(entry, ';');
+        size_t entry_len = next ? (size_t) (next - entry) : strlen(entry);
+        if (entry_len > name_len && strncmp(entry, name, name_len) == 0 && entry[name_len] == ':')
+            add_options(entry + name_len + 1, entry_len - name_len - 1, size, result, len);
+
+        entry = next ? next + 1 : NULL;
+    }
+}
+
+static int size_option(const char *opt, const char *str, unsigned long long *bytes)
+{
+    if (parse_size(str, bytes) == 0)
+        return 0;
+
+    elog(ELOG_WARNING, "Ignoring invalid tmpfs %s '%s'", opt, str);
+    return -1;
+}
+
+static void add_size(const struct tmpfs_size *size, char *result, size_t len)
+{
+    char size_opt[64];
+    if (size->min[0] == '\0' && size->max[0] == '\0') {
+        // Let the kernel handle it. This is the common case.
+        if (size->size[0] == '\0')
+            return;
+        snprintf(size_opt, sizeof(size_opt), "size=%s", size->size);
+    } else {
+        unsigned long long bytes;
+        unsigned long long limit;
+        if (size->size[0] == '\0' || size_option("size", size->size, &bytes) < 0)
+            bytes = total_ram() / 2; // tmpfs default
+
+        if (size->max[0] != '\0' && size_option("max", size->max, &limit) == 0 && bytes > limit)
+            bytes = limit;
+        if (size->min[0] != '\0' && size_option("min", size->min, &limit) == 0 && bytes < limit)
+            bytes = limit;
+
+        snprintf(size_opt, sizeof(size_opt), "size=%llu", bytes);
+    }
+    append_option(result, len, size_opt);
+}
+
+// Build the mount(2) options for one of erlinit's tmpfs mounts. The name
+// is "/tmp", "/run" or "overlay".
+void tmpfs_options(const char *name, const char *defaults, char *result, size_t len)
+{
+    struct tmpfs_size size;
+    memset(&size, 0, sizeof(size));
+    *result = '\0';
+
+    add_options(defaults, strlen(defaults), &size, result, len);
+    add_entries("default", &size, result, len);
+    add_entries(name, &size, result, len);
+    add_size(&size, result, len);
+}
@@ -6,7 +6,15 @@
 #include "erlinit.h"
 
 #include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef __APPLE__
+#include <sys/sysinfo.h>
+#endif
 
 void trim_whitespace(char *s)
 {
@@ -22,3 +30,65 @@ void trim_whitespace(char *s)
         memmove(s, left, len);
     s[len] = 0;
 }
+
+int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return (int) syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void) pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+unsigned long long total_ram()
+{
+#ifndef __APPLE__
+    struct sysinfo info;
+    if (sysinfo(&info) < 0)
+        return 0;
+
+    return (unsigned long long) info.totalram * info.mem_unit;
+#else
+    return 0;
+#endif
+}
+
+// Parse sizes like tmpfs does. E.g., "1048576", "512k", "16m", "1g" or "10%"
+// where percentages are of the total RAM.
+int parse_size(const char *str, unsigned long long *bytes)
+{
+    char *end;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (end == str)
+        return -1;
+
+    switch (*end) {
+    case '%':
+        value = total_ram() * value / 100;
+        end++;
+        break;
+    case 'g':
+    case 'G':
+        value <<= 10;
+    // fall through
+    case 'm':
+    case 'M':
+        value <<= 10;
+    // fall through
+    case 'k':
+    case 'K':
+        value <<= 10;
+        end++;
+        break;
+    default:
+        break;
+    }
+
+    if (*end != '\0')
+        return -1;
+
+    *bytes = value;
+    return 0;
+}
@@ -0,0 +1,273 @@
+// SPDX-FileCopyrightText: 2026 Frank Hunleth
+//
+// SPDX-License-Identifier: MIT
+//
+
+#include "erlinit.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <unistd.h>
+
+#ifndef __APPLE__
+#include <sys/swap.h>
+#endif
+
+// zram devices are compressed RAM disks. erlinit sets them up before the
+// Erlang VM starts so that swap is available from the beginning. They can
+// also hold /tmp or the --x-pivot-root-on-overlayfs upper layer.
+//
+// --zram entries are stored as "use:disksize:options;use:disksize:options"
+// where use is "swap", "/tmp" or "overlay".
+
+struct zram_config {
+    char use[16];
+    unsigned long long disksize;
+    char algorithm[32];
+    unsigned long long mem_limit;
+    int priority;
+    char fs[16];
+    int discard;
+};
+
+static int parse_zram_entry(const char *entry, size_t len, struct zram_config *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->priority = -1;
+    strcpy(config->fs, "ext4");
+    config->discard = 1;
+
+    char *copy = strndup(entry, len);
+    char *temp = copy;
+    const char *use = strsep(&temp, ":");
+    const char *disksize = strsep(&temp, ":");
+    int rc = -1;
+    if (!disksize || parse_size(disksize, &config->disksize) < 0 || config->disksize == 0) {
+        elog(ELOG_WARNING, "Ignoring --zram '%.*s'. Expecting a disk size.", (int) len, entry);
+        goto cleanup;
+    }
+    snprintf(config->use, sizeof(config->use), "%s", use);
+
+    const char *opt;
+    while ((opt = strsep(&temp, ",")) != NULL) {
+        if (strncmp(opt, "algorithm=", 10) == 0)
+            snprintf(config->algorithm, sizeof(config->algorithm), "%s", opt + 10);
+        else if (strncmp(opt, "mem_limit=", 10) == 0 && parse_size(opt + 10, &config->mem_limit) == 0)
+            ;
+        else if (strncmp(opt, "priority=", 9) == 0)
+            config->priority = strtol(opt + 9, NULL, 0);
+        else if (strncmp(opt, "fs=", 3) == 0)
+            snprintf(config->fs, sizeof(config->fs), "%s", opt + 3);
+        else if (strcmp(opt, "nodiscard") == 0)
+            config->discard = 0;
+        else if (*opt != '\0')
+            elog(ELOG_WARNING, "Ignoring unknown --zram option '%s'", opt);
+    }
+    rc = 0;
+
+cleanup:
+    free(copy);
+    return rc;
+}
+
+// Find the next entry for a use starting at *cursor
+static int next_zram_entry(const char **cursor, const char *use, struct zram_config *config)
+{
+    size_t use_len = strlen(use);
+    while (*cursor) {
+        const char *entry = *cursor;
+        const char *next = strchr(entry, ';');
+        size_t entry_len = next ? (size_t) (next - entry) : strlen(entry);
+        *cursor = next ? next + 1 : NULL;
+
+        if (entry_len > use_len && strncmp(entry, use, use_len) == 0 && entry[use_len] == ':' &&
+                parse_zram_entry(entry, entry_len, config) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int read_sysfs(const char *path, char *value, size_t len)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    ssize_t amount = read(fd, value, len - 1);
+    close(fd);
+    if (amount < 0)
+        return -1;
+
+    value[amount] = '\0';
+    trim_whitespace(value);
+    return 0;
+}
+
+static int write_zram_attr(int index, const char *attr, const char *value)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/block/zram%d/%s", index, attr);
+
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || write(fd, value, strlen(value)) < 0) {
+        elog(ELOG_WARNING, "Cannot write '%s' to %s: %s", value, path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+static int allocate_zram()
+{
+    // Use the first zram device that hasn't been set up yet. The zram
+    // module creates one by default. Ask for more with hot_add.
+    for (int index = 0; ; index++) {
+        char path[64];
+        char disksize[32];
+        snprintf(path, sizeof(path), "/sys/block/zram%d/disksize", index);
+        if (read_sysfs(path, disksize, sizeof(disksize)) < 0)
+            break;
+        if (strcmp(disksize, "0") == 0)
+            return index;
+    }
+
+    char index_str[16];
+    if (read_sysfs("/sys/class/zram-control/hot_add", index_str, sizeof(index_str)) < 0) {
+        elog(ELOG_WARNING, "No zram devices available. Check that CONFIG_ZRAM is enabled.");
+        return -1;
+    }
+    return strtol(index_str, NULL, 10);
+}
+
+// Returns the zram device's index or -1
+static int setup_zram_device(const struct zram_config *config, char *device, size_t len)
+{
+    int index = allocate_zram();
+    if (index < 0)
+        return -1;
+
+    // The compression algorithm has to be set before the disk size
+    char value[32];
+    if (config->algorithm[0] != '\0')
+        write_zram_attr(index, "comp_algorithm", config->algorithm);
+
+    snprintf(value, sizeof(value), "%llu", config->disksize);
+    if (write_zram_attr(index, "disksize", value) < 0)
+        return -1;
+
+    if (config->mem_limit > 0) {
+        snprintf(value, sizeof(value), "%llu", config->mem_limit);
+        write_zram_attr(index, "mem_limit", value);
+    }
+
+    snprintf(device, len, "/dev/zram%d", index);
+    return index;
+}
+
+#ifndef __APPLE__
+static int write_swap_header(const char *device, unsigned long long disksize)
+{
+    // This is what mkswap(8) writes minus the UUID and label. The header
+    // fields are right after the first 1024 bytes and the signature is at
+    // the end of the first page.
+    long page_size = sysconf(_SC_PAGESIZE);
+    uint8_t *header = calloc(1, page_size);
+    if (!header) {
+        elog(ELOG_WARNING, "Cannot write swap header to %s: out of memory", device);
+        return -1;
+    }
+
+    uint32_t *info = (uint32_t *) (header + 1024);
+    info[0] = 1; // version
+    info[1] = (uint32_t) (disksize / page_size - 1); // last_page
+    info[2] = 0; // nr_badpages
+    memcpy(header + page_size - 10, "SWAPSPACE2", 10);
+
+    int rc = -1;
+    int fd = open(device, O_WRONLY | O_CLOEXEC);
+    if (fd >= 0 && write(fd, header, page_size) == page_size)
+        rc = 0;
+    else
+        elog(ELOG_WARNING, "Cannot write swap header to %s: %s", device, strerror(errno));
+
+    if (fd >= 0)
+        close(fd);
+    free(header);
+    return rc;
+}
+
+void setup_zram_swap()
+{
+    const char *cursor = options.zram;
+    struct zram_config config;
+    while (next_zram_entry(&cursor, "swap", &config)) {
+        char device[32];
+        int index = setup_zram_device(&config, device, sizeof(device));
+        if (index < 0)
+            continue;
+        if (write_swap_header(device, config.disksize) < 0) {
+            write_zram_attr(index, "reset", "1");
+            continue;
+        }
+
+        int flags = SWAP_FLAG_DISCARD;
+        if (config.priority >= 0)
+            flags |= SWAP_FLAG_PREFER | ((config.priority << SWAP_FLAG_PRIO_SHIFT) & SWAP_FLAG_PRIO_MASK);
+
+        OK_OR_WARN(swapon(device, flags), "Cannot enable swap on %s", device);
+    }
+}
+#else
+void setup_zram_swap()
+{
+}
+#endif
+
+int has_zram(const char *use)
+{
+    const char *cursor = options.zram;
+    struct zram_config config;
+    return next_zram_entry(&cursor, use, &config);
+}
+
+int mount_zram(const char *use, const char *target, unsigned long flags)
+{
+    // Format a zram device and mount it. Returns -1 so that the caller can
+    // use a tmpfs instead if anything goes wrong.
+    const char *cursor = options.zram;
+    struct zram_config config;
+    char device[32];
+    if (!next_zram_entry(&cursor, use, &config))
+        return -1;
+
+    int index = setup_zram_device(&config, device, sizeof(device));
+    if (index < 0)
+        return -1;
+
+    char cmd[128];
+    char output[256];
+    snprintf(cmd, sizeof(cmd), "/sbin/mkfs.%s %s", config.fs, device);
+    if (system_cmd(cmd, output, sizeof(output)) != 0) {
+        elog(ELOG_WARNING, "'%s' failed. Using tmpfs for %s.", cmd, target);
+        goto reset;
+    }
+
+    // Without discard, deleted files keep using zram memory
+    if (mount(device, target, config.fs, flags, config.discard ? "discard" : NULL) < 0) {
+        elog(ELOG_WARNING, "Cannot mount %s at %s: %s. Using tmpfs.", device, target, strerror(errno));
+        goto reset;
+    }
+    return 0;
+
+reset:
+    // Give the memory back since the tmpfs is used instead
+    write_zram_attr(index, "reset", "1");
+    return -1;
+}
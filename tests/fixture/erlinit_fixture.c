@@ -26,6 +26,17 @@
 #include <pwd.h>
 #include <sys/resource.h>
 #include <sys/syscall.h>
+#include <spawn.h>
+#include <errno.h>
+
+#ifndef __APPLE__
+#include <sys/fanotify.h>
+#include <sys/prctl.h>
+#include <sys/sysinfo.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <sys/mman.h>
+#endif
 
 #ifndef __APPLE__
 #include <linux/random.h>
@@ -69,6 +80,15 @@ __attribute__((constructor)) void fixture_init()
 
     work = getenv("WORK");
 
+#ifndef __APPLE__
+    // PID 1 gets all orphans. Tests that want erlinit to reap them opt in.
+    char subreaper_path[PATH_MAX];
+    if (work &&
+            snprintf(subreaper_path, sizeof(subreaper_path), "%s/subreaper", work) < (int) sizeof(subreaper_path) &&
+            access(subreaper_path, F_OK) == 0)
+        prctl(PR_SET_CHILD_SUBREAPER, 1);
+#endif
+
     // Don't wrap child processes
     unsetenv("LD_PRELOAD");
     unsetenv("DYLD_INSERT_LIBRARIES");
@@ -87,6 +107,30 @@ static int fixup_path(const char *input, char *output)
     return 0;
 }
 
+OVERRIDE(int, rename, (const char *oldpath, const char *newpath))
+{
+    char new_oldpath[PATH_MAX];
+    char new_newpath[PATH_MAX];
+    if (fixup_path(oldpath, new_oldpath) < 0 || fixup_path(newpath, new_newpath) < 0)
+        return -1;
+
+    return ORIGINAL(rename)(new_oldpath, new_newpath);
+}
+
+static void simulate_devtmpfs()
+{
+    // Tests can check what happens when device files appear after /dev is
+    // mounted by putting them in $WORK/devtmpfs.
+    static const char *devices[] = {"kmsg", "pmsg0", NULL};
+    for (const char **device = devices; *device; device++) {
+        char from[PATH_MAX];
+        char to[PATH_MAX];
+        sprintf(from, "%s/devtmpfs/%s", work, *device);
+        sprintf(to, "%s/dev/%s", work, *device);
+        (void) ORIGINAL(rename)(from, to);
+    }
+}
+
 #ifdef __APPLE__
 REPLACE(int, mount, (const char *type, const char *dir, int flags, void *data))
 {
@@ -95,6 +139,8 @@ REPLACE(int, mount, (const char *type, const char *dir, int flags, void *data))
     const char *filesystemtype = data;
 
     log("mount(\"%s\", \"%s\", \"%s\", %d, data)", type, dir, filesystemtype, flags);
+    if (strcmp(filesystemtype, "devtmpfs") == 0)
+        simulate_devtmpfs();
     return 0;
 }
 
@@ -110,9 +156,15 @@ REPLACE(int, mount, (const char *source, const char *target,
           const char *filesystemtype, unsigned long mountflags,
           const void *data))
 {
-    (void) data;
-
-    log("mount(\"%s\", \"%s\", \"%s\", %lu, data)", source, target, filesystemtype, mountflags);
+    // Tests that check mount options opt in so that the others don't change
+    char data_path[PATH_MAX];
+    sprintf(data_path, "%s/log_mount_data", work);
+    if (data && access(data_path, F_OK) == 0)
+        log("mount(\"%s\", \"%s\", \"%s\", %lu, \"%s\")", source, target, filesystemtype, mountflags, (const char *) data);
+    else
+        log("mount(\"%s\", \"%s\", \"%s\", %lu, data)", source, target, filesystemtype, mountflags);
+    if (filesystemtype && strcmp(filesystemtype, "devtmpfs") == 0)
+        simulate_devtmpfs();
     return 0;
 }
 
@@ -121,6 +173,12 @@ REPLACE(int, umount, (const char *target))
     log("umount(\"%s\")", target);
     return 0;
 }
+
+REPLACE(int, umount2, (const char *target, int flags))
+{
+    log("umount2(\"%s\", %d)", target, flags);
+    return 0;
+}
 #endif
 
 OVERRIDE(FILE *, fopen, (const char *pathname, const char *mode))
@@ -166,6 +224,86 @@ REPLACE(int, clock_gettime, (clockid_t clock_id, struct timespec *tp))
 
 // syscall gives a deprecation warning on MacOS, so handle this is compat.c
 #ifndef __APPLE__
+#ifdef SYS_fsopen
+// The new mount API is simulated with memfds that hold a description of the
+// filesystem. This works across processes since erlinit creates mounts in
+// workers and passes the file descriptors back. Only move_mount is logged
+// since the others happen concurrently. Create $WORK/no_new_mount_api to
+// simulate a kernel without it.
+static void mount_api_append(int fd, const char *str)
+{
+    (void) lseek(fd, 0, SEEK_END);
+    (void) write(fd, str, strlen(str));
+}
+
+static long fake_fsopen(const char *fstype)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/no_new_mount_api", work);
+    if (access(path, F_OK) == 0) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    int fd = memfd_create("fsopen", MFD_CLOEXEC);
+    mount_api_append(fd, fstype);
+    return fd;
+}
+
+static long fake_fsconfig(int fd, unsigned int cmd, const char *key, const char *value)
+{
+    char option[PATH_MAX];
+    if (cmd == 0) // FSCONFIG_SET_FLAG
+        snprintf(option, sizeof(option), "\n%s", key);
+    else if (cmd == 1) // FSCONFIG_SET_STRING
+        snprintf(option, sizeof(option), "\n%s=%s", key, value);
+    else
+        return 0;
+
+    mount_api_append(fd, option);
+    return 0;
+}
+
+static long fake_fsmount(int fsfd, unsigned int attrs)
+{
+    char contents[PATH_MAX];
+    ssize_t len = pread(fsfd, contents, sizeof(contents) - 1, 0);
+    contents[len > 0 ? len : 0] = '\0';
+
+    int fd = memfd_create("fsmount", MFD_CLOEXEC);
+    mount_api_append(fd, contents);
+    snprintf(contents, sizeof(contents), "\nattrs=%u", attrs);
+    mount_api_append(fd, contents);
+    return fd;
+}
+
+static long fake_move_mount(int from_fd, const char *to_path)
+{
+    char contents[PATH_MAX];
+    ssize_t len = pread(from_fd, contents, sizeof(contents) - 1, 0);
+    contents[len > 0 ? len : 0] = '\0';
+
+    const char *fstype = strtok(contents, "\n");
+    const char *source = "";
+    const char *attrs = "";
+    char options[PATH_MAX] = "";
+    char *line;
+    while ((line = strtok(NULL, "\n")) != NULL) {
+        if (strncmp(line, "source=", 7) == 0)
+            source = line + 7;
+        else if (strncmp(line, "attrs=", 6) == 0)
+            attrs = line + 6;
+        else {
+            if (options[0] != '\0')
+                strcat(options, ",");
+            strcat(options, line);
+        }
+    }
+    log("move_mount(\"%s\", \"%s\", \"%s\", %s, \"%s\")", source, to_path, fstype, attrs, options);
+    return 0;
+}
+#endif
+
 REPLACE(long, syscall, (long number, ...))
 {
     unsigned int magic1;
@@ -175,6 +313,27 @@ REPLACE(long, syscall, (long number, ...))
 
     va_list ap;
     va_start(ap, number);
+    if (number != SYS_reboot) {
+        // Pass everything else through (e.g., pidfd_open)
+        long args[6];
+        for (int i = 0; i < 6; i++)
+            args[i] = va_arg(ap, long);
+        va_end(ap);
+
+#ifdef SYS_fsopen
+        if (number == SYS_fsopen)
+            return fake_fsopen((const char *) args[0]);
+        else if (number == SYS_fsconfig)
+            return fake_fsconfig((int) args[0], (unsigned int) args[1], (const char *) args[2], (const char *) args[3]);
+        else if (number == SYS_fsmount)
+            return fake_fsmount((int) args[0], (unsigned int) args[2]);
+        else if (number == SYS_move_mount)
+            return fake_move_mount((int) args[0], (const char *) args[3]);
+#endif
+
+        long (*original_syscall)(long, ...) = dlsym(RTLD_NEXT, "syscall");
+        return original_syscall(number, args[0], args[1], args[2], args[3], args[4], args[5]);
+    }
     magic1 = va_arg(ap, int);
     magic2 = va_arg(ap, int);
     cmd = va_arg(ap, int);
@@ -195,6 +354,17 @@ REPLACE(long, syscall, (long number, ...))
 }
 #endif
 
+#ifndef __APPLE__
+REPLACE(int, sysinfo, (struct sysinfo *info))
+{
+    // Pretend to be a 128 MB board
+    memset(info, 0, sizeof(struct sysinfo));
+    info->totalram = 128 * 1024 * 1024;
+    info->mem_unit = 1;
+    return 0;
+}
+#endif
+
 REPLACE(int, clock_settime, (clockid_t clk_id, const struct timespec *tp))
 {
     (void) clk_id;
@@ -218,6 +388,10 @@ REPLACE(int, setgid, (gid_t gid))
 
 REPLACE(int, kill, (pid_t pid, int sig))
 {
+    // Signaling one process is safe, but the pid changes every run
+    if (pid > 0)
+        return (int) syscall(SYS_kill, pid, sig);
+
     log("kill(%d, %d)", pid, sig);
     return 0;
 }
@@ -264,6 +438,8 @@ REPLACE(struct passwd *, getpwuid, (uid_t uid))
     return uid != 1 ? &pwd : NULL;
 }
 
+static void record_log_open(const char *pathname);
+
 OVERRIDE(int, open, (const char *pathname, int flags, ...))
 {
     int mode;
@@ -276,6 +452,9 @@ OVERRIDE(int, open, (const char *pathname, int flags, ...))
         mode = 0;
     va_end(ap);
 
+    if (strcmp(pathname, "/dev/kmsg") == 0 || strcmp(pathname, "/dev/pmsg0") == 0)
+        record_log_open(pathname);
+
     if (strcmp(pathname, "/dev/kmsg") == 0) {
         // If /dev/kmsg exists, then force append for test purposes
         // Fake out read requests since those are always mocked.
@@ -297,6 +476,18 @@ OVERRIDE(int, open, (const char *pathname, int flags, ...))
     return ORIGINAL(open)(new_path, flags, mode);
 }
 
+static void record_log_open(const char *pathname)
+{
+    // Tests that count how often log devices get opened create this file
+    char path[PATH_MAX];
+    sprintf(path, "%s/log_opens", work);
+    int fd = ORIGINAL(open)(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd >= 0) {
+        dprintf(fd, "open(\"%s\")\n", pathname);
+        close(fd);
+    }
+}
+
 OVERRIDE(int, close, (int fd))
 {
     // Ignore the default file handles when testing since we lose errors
@@ -361,6 +552,38 @@ OVERRIDE(int, chdir, (const char * path))
     return ORIGINAL(chdir)(new_path);
 }
 
+OVERRIDE(int, unlink, (const char *path))
+{
+    char new_path[PATH_MAX];
+    if (fixup_path(path, new_path) < 0)
+        return -1;
+
+    return ORIGINAL(unlink)(new_path);
+}
+
+OVERRIDE(int, posix_spawnp, (pid_t *pid, const char *file, const posix_spawn_file_actions_t *file_actions, const posix_spawnattr_t *attrp, char *const argv[], char *const envp[]))
+{
+    char new_path[PATH_MAX];
+    if (fixup_path(file, new_path) < 0)
+        return ENOENT;
+
+    return ORIGINAL(posix_spawnp)(pid, new_path, file_actions, attrp, argv, envp);
+}
+
+OVERRIDE(char *, getcwd, (char *buf, size_t size))
+{
+    // Undo the chdir fixup so that erlinit sees paths in its root
+    char *rc = ORIGINAL(getcwd)(buf, size);
+    size_t work_len = strlen(work);
+    if (rc && strncmp(rc, work, work_len) == 0) {
+        if (rc[work_len] == '\0')
+            strcpy(rc, "/");
+        else if (rc[work_len] == '/')
+            memmove(rc, rc + work_len, strlen(rc + work_len) + 1);
+    }
+    return rc;
+}
+
 OVERRIDE(int, execvp, (const char *file, char *const argv[]))
 {
     char new_path[PATH_MAX];
@@ -637,3 +860,193 @@ REPLACE(int, setrlimit, (__rlimit_resource_t resource, const struct rlimit *new_
     log("setrlimit(%s, %s, %s)", resource_to_string(resource), cur, max);
     return 0;
 }
+
+OVERRIDE(ssize_t, readlink, (const char *pathname, char *buf, size_t bufsiz))
+{
+    // Remove the working directory from paths to open files so that
+    // they look like what erlinit would see
+    ssize_t count = ORIGINAL(readlink)(pathname, buf, bufsiz);
+    size_t work_len = strlen(work);
+    if (count > (ssize_t) work_len && strncmp(pathname, "/proc/", 6) == 0 && strncmp(buf, work, work_len) == 0) {
+        memmove(buf, buf + work_len, count - work_len);
+        count -= work_len;
+    }
+    return count;
+}
+
+static const char *fd_to_path(int fd, char *path, size_t len)
+{
+    // Report paths like erlinit sees them
+    char proc_path[64];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+    ssize_t count = ORIGINAL(readlink)(proc_path, path, len - 1);
+    if (count < 0)
+        return "unknown";
+    path[count] = '\0';
+
+    size_t work_len = strlen(work);
+    if (strncmp(path, work, work_len) == 0)
+        return path[work_len] ? path + work_len : "/";
+    return path;
+}
+
+#ifndef __APPLE__
+REPLACE(int, syncfs, (int fd))
+{
+    char path[PATH_MAX];
+    log("syncfs(\"%s\")", fd_to_path(fd, path, sizeof(path)));
+    return 0;
+}
+#endif
+
+#ifndef __APPLE__
+REPLACE(int, posix_fadvise, (int fd, off_t offset, off_t len, int advice))
+{
+    char path[PATH_MAX];
+    log("posix_fadvise(\"%s\", %ld, %ld, %d)", fd_to_path(fd, path, sizeof(path)), (long) offset, (long) len, advice);
+    return 0;
+}
+#endif
+
+#ifndef __APPLE__
+REPLACE(int, fanotify_init, (unsigned int flags, unsigned int event_f_flags))
+{
+    (void) event_f_flags;
+    log("fanotify_init(0x%x)", flags);
+
+    // Simulate opens by returning a pipe with an event for each file listed
+    // in $WORK/fanotify_events
+    int fds[2];
+    if (pipe(fds) < 0)
+        return -1;
+
+    char events_path[PATH_MAX];
+    sprintf(events_path, "%s/fanotify_events", work);
+    FILE *fp = ORIGINAL(fopen)(events_path, "r");
+    if (fp) {
+        char line[PATH_MAX];
+        while (fgets(line, sizeof(line), fp)) {
+            line[strcspn(line, "\n")] = '\0';
+
+            char path[PATH_MAX];
+            if (fixup_path(line, path) < 0)
+                continue;
+
+            struct fanotify_event_metadata event;
+            memset(&event, 0, sizeof(event));
+            event.event_len = sizeof(event);
+            event.vers = FANOTIFY_METADATA_VERSION;
+            event.metadata_len = sizeof(event);
+            event.mask = FAN_OPEN;
+            event.fd = ORIGINAL(open)(path, O_RDONLY);
+            event.pid = 1000;
+            if (write(fds[1], &event, sizeof(event)) < 0)
+                break;
+        }
+        fclose(fp);
+    }
+    ORIGINAL(close)(fds[1]);
+    return fds[0];
+}
+
+REPLACE(int, fanotify_mark, (int fanotify_fd, unsigned int flags, uint64_t mask, int dirfd, const char *pathname))
+{
+    (void) fanotify_fd;
+    (void) dirfd;
+    log("fanotify_mark(0x%x, 0x%llx, \"%s\")", flags, (unsigned long long) mask, pathname);
+    return 0;
+}
+#endif
+
+#ifndef __APPLE__
+static int uevent_fd = -1;
+
+OVERRIDE(int, socket, (int domain, int type, int protocol))
+{
+    if (domain != AF_NETLINK || protocol != NETLINK_KOBJECT_UEVENT)
+        return ORIGINAL(socket)(domain, type, protocol);
+
+    // Simulate hotplugged devices by sending an add uevent for each
+    // device listed in $WORK/uevents. The device file is created when
+    // erlinit receives the uevent. See recv().
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, fds) < 0)
+        return -1;
+
+    char events_path[PATH_MAX];
+    sprintf(events_path, "%s/uevents", work);
+    FILE *fp = ORIGINAL(fopen)(events_path, "r");
+    if (fp) {
+        char line[PATH_MAX];
+        while (fgets(line, sizeof(line), fp)) {
+            line[strcspn(line, "\n")] = '\0';
+            if (strncmp(line, "/dev/", 5) != 0)
+                continue;
+
+            char msg[PATH_MAX * 2];
+            int len = sprintf(msg, "add@/devices/virtual/block/%s", line + 5) + 1;
+            len += sprintf(&msg[len], "ACTION=add") + 1;
+            len += sprintf(&msg[len], "DEVNAME=%s", line + 5) + 1;
+            if (send(fds[1], msg, len, 0) < 0)
+                break;
+        }
+        fclose(fp);
+    }
+
+    // Keep the other end open so that the socket doesn't look closed
+    uevent_fd = fds[0];
+    return fds[0];
+}
+
+OVERRIDE(int, bind, (int sockfd, const struct sockaddr *addr, socklen_t addrlen))
+{
+    if (sockfd == uevent_fd)
+        return 0;
+
+    return ORIGINAL(bind)(sockfd, addr, addrlen);
+}
+
+OVERRIDE(ssize_t, recv, (int sockfd, void *buf, size_t len, int flags))
+{
+    ssize_t rc = ORIGINAL(recv)(sockfd, buf, len, flags);
+    if (sockfd != uevent_fd || rc <= 0)
+        return rc;
+
+    for (const char *field = buf; field < (const char *) buf + rc; field += strlen(field) + 1) {
+        if (strncmp(field, "DEVNAME=", 8) == 0) {
+            char path[PATH_MAX];
+            sprintf(path, "%s/dev/%s", work, field + 8);
+            int fd = ORIGINAL(open)(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+            if (fd >= 0)
+                ORIGINAL(close)(fd);
+        }
+    }
+    return rc;
+}
+#endif
+
+#ifndef __APPLE__
+REPLACE(int, swapon, (const char *path, int swapflags))
+{
+    // Check the signature and size that erlinit wrote in place of mkswap
+    char new_path[PATH_MAX];
+    if (fixup_path(path, new_path) < 0)
+        return -1;
+
+    char header[4096];
+    int fd = ORIGINAL(open)(new_path, O_RDONLY);
+    if (fd < 0 || read(fd, header, sizeof(header)) != sizeof(header)) {
+        log("swapon(\"%s\", 0x%x) no swap header", path, swapflags);
+        if (fd >= 0)
+            ORIGINAL(close)(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    ORIGINAL(close)(fd);
+
+    unsigned int last_page;
+    memcpy(&last_page, &header[1028], sizeof(last_page));
+    log("swapon(\"%s\", 0x%x) %.10s last_page=%u", path, swapflags, &header[sizeof(header) - 10], last_page);
+    return 0;
+}
+#endif
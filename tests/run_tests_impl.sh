@@ -49,6 +49,12 @@ run() {
     KMSG_EXPECTED=$WORK/$TEST.kmsg_expected
     KMSG=$WORK/dev/kmsg
 
+    # Tests that run things concurrently can set this to compare sorted results
+    UNORDERED_RESULTS=
+
+    # Tests can list files that erlinit writes to append them to the results
+    OUTPUT_FILES=
+
     echo "Running $TEST..."
 
     # Setup a fake root directory to simulate erlinit boot
@@ -102,13 +108,15 @@ run() {
     ln -s "$(tty)" "$WORK/dev/tty1"
 
     # Fake mounts
-    cat >"$WORK/proc/mounts" << EOF
-/dev/root / squashfs ro,relatime 0 0
-sysfs /sys sysfs rw,nosuid,nodev,noexec,relatime 0 0
-proc /proc proc rw,nosuid,nodev,noexec,relatime 0 0
-devpts /dev/pts devpts rw,nosuid,noexec,relatime,gid=5,mode=620,ptmxmode=000 0 0
-tmpfs /dev/shm tmpfs rw,nosuid,nodev 0 0
-tmpfs /sys/fs/cgroup tmpfs ro,nosuid,nodev,noexec,mode=755 0 0
+    mkdir -p "$WORK/proc/self"
+    cat >"$WORK/proc/self/mountinfo" << EOF
+15 1 179:2 / / ro,relatime - squashfs /dev/root ro
+16 15 0:15 / /sys rw,nosuid,nodev,noexec,relatime - sysfs sysfs rw
+17 15 0:4 / /proc rw,nosuid,nodev,noexec,relatime - proc proc rw
+18 15 0:6 / /dev rw,nosuid,noexec,relatime - devtmpfs devtmpfs rw,size=1024k,mode=755
+19 18 0:20 / /dev/pts rw,nosuid,noexec,relatime - devpts devpts rw,gid=5,mode=620,ptmxmode=000
+20 18 0:21 / /dev/shm rw,nosuid,nodev - tmpfs tmpfs rw
+21 16 0:22 / /sys/fs/cgroup ro,nosuid,nodev,noexec - tmpfs tmpfs ro,mode=755
 EOF
     # Fake random info
     mkdir -p "$WORK/proc/sys/kernel/random"
@@ -128,11 +136,13 @@ EOF
         CMDLINE=
     fi
 
-    if [ -e "$PMSG_EXPECTED" ]; then
+    # Create the log devices unless the test wants them to appear when
+    # devtmpfs is mounted
+    if [ -e "$PMSG_EXPECTED" ] && [ ! -e "$WORK/devtmpfs/pmsg0" ]; then
         touch "$PMSG"
     fi
 
-    if [ -e "$KMSG_EXPECTED" ]; then
+    if [ -e "$KMSG_EXPECTED" ] && [ ! -e "$WORK/devtmpfs/kmsg" ]; then
         touch "$KMSG"
     fi
 
@@ -141,6 +151,10 @@ EOF
     #       need a subshell - hence the parentheses.
     (LD_PRELOAD=$FIXTURE DYLD_INSERT_LIBRARIES=$FIXTURE WORK=$WORK exec -a /sbin/init $ERLINIT $CMDLINE 2> "$RESULTS.raw")
 
+    for OUTPUT_FILE in $OUTPUT_FILES; do
+        cat "$WORK$OUTPUT_FILE" >> "$RESULTS.raw"
+    done
+
     # Trim the results of known lines that vary between runs
     # The calls to sed fixup differences between getopt implementations.
     cat "$RESULTS.raw" | \
@@ -158,6 +172,13 @@ EOF
         $SED -e "s/invalid option -- 'Z'/invalid option -- Z/" \
         > "$RESULTS"
 
+    if [ -n "$UNORDERED_RESULTS" ]; then
+        LC_ALL=C sort "$RESULTS" > "$RESULTS.sorted"
+        mv "$RESULTS.sorted" "$RESULTS"
+        LC_ALL=C sort "$EXPECTED" > "$EXPECTED.sorted"
+        mv "$EXPECTED.sorted" "$EXPECTED"
+    fi
+
     # check results
     diff -w "$RESULTS" "$EXPECTED"
     if [ $? != 0 ]; then